@@ -21,7 +21,7 @@ MODULE_LICENSE("GPL");
 
 /*------------------------------Module--------------------------------*/
 
-/* Parameter for number of messages */
+/* Parameter for the queue budget, in messages of max length */
 static unsigned long blk_mnum = 8;
 module_param(blk_mnum, ulong, S_IRUGO);
 
@@ -29,10 +29,40 @@ module_param(blk_mnum, ulong, S_IRUGO);
 static unsigned long blk_mlen = 64;
 module_param(blk_mlen, ulong, S_IRUGO);
 
+/* Parameter for the queue budget in KiB (0: blk_mnum messages) */
+static unsigned long queue_kb = 0;
+module_param(queue_kb, ulong, S_IRUGO);
+
+/* Parameter for the max number of messages per queue (0: no limit) */
+static unsigned long blk_slots = 0;
+module_param(blk_slots, ulong, S_IRUGO);
+
 /* Parameter for XOR key*/
 static char key = 'k';
 module_param(key, byte, S_IRUGO);
 
+/* Parameter for CRC32C record header on read (see tmod_uapi.h) */
+static bool tag = false;
+module_param(tag, bool, S_IRUGO);
+
+/* Parameter for the stage list, applied in order (xor, lz4) */
+static char *stages = "xor";
+module_param(stages, charp, S_IRUGO);
+
+/* Parameter for the busy poll budget cap in us (0: always sleep) */
+static unsigned long poll_us = 0;
+module_param(poll_us, ulong, S_IRUGO);
+
+/* Parameter for the result cache size in KiB (0: off) */
+static unsigned long cache_kb = 0;
+module_param(cache_kb, ulong, S_IRUGO);
+
+/* Parameter for the staging timeout of small writes in us (0: no coalescing) */
+static unsigned long coalesce_us = 0;
+module_param(coalesce_us, ulong, S_IRUGO);
+
+static const char *dev_name_str = "enc_dev";
+
 struct cdev_ctx *ctx;
 
 /*--------------------------------------------------------------------*/
@@ -40,8 +70,21 @@ struct cdev_ctx *ctx;
 static int __init tmod_init(void)
 {
 	int retval;
+	struct tmod_cdev_cfg cfg = {
+		.name		= dev_name_str,
+		.blk_mnum	= blk_mnum,
+		.blk_mlen	= blk_mlen,
+		.queue_mem	= queue_kb * 1024,
+		.blk_slots	= blk_slots,
+		.key		= key,
+		.tag		= tag,
+		.stages		= stages,
+		.poll_us	= poll_us,
+		.cache_mem	= cache_kb * 1024,
+		.coalesce_us	= coalesce_us,
+	};
 	
-	retval = tmod_cdev_create(&ctx, blk_mnum, blk_mlen, key);
+	retval = tmod_cdev_create(&ctx, &cfg);
 	if (retval) {
 		printk(KERN_ALERT "tmod: failed to register device\n");
 	} else {
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#include <linux/mm.h>				/* kvmalloc, page_address */
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>			/* vmap */
+#include <linux/uaccess.h>
+#include <linux/memcontrol.h>		/* mem_cgroup_put */
+#include <linux/log2.h>				/* roundup_pow_of_two */
+#include <linux/version.h>
+
+#include "tmod_blk.h"
+
+/* Largest inline block: header and data fit a single page */
+#define TMOD_BLK_INLINE_MAX		(PAGE_SIZE - sizeof(struct tmod_blk))
+
+struct tmod_blk *tmod_blk_alloc(size_t mlen, gfp_t gfp)
+{
+	struct tmod_blk *blk;
+	unsigned int pages_num;
+	unsigned int i;
+	
+	if (mlen <= TMOD_BLK_INLINE_MAX) {
+		blk = kmalloc(sizeof(*blk) + mlen, gfp);
+		if (!blk) {
+			return NULL;
+		}
+		
+		memset(blk, 0, sizeof(*blk));
+		blk->data = (char *)blk + sizeof(*blk);
+		blk->mlen = mlen;
+		
+		return blk;
+	}
+	
+	/* The page vector itself may be large: let it fall back to vmalloc */
+	pages_num = DIV_ROUND_UP(mlen, PAGE_SIZE);
+	blk = kvzalloc(sizeof(*blk) + pages_num * sizeof(blk->pages[0]), gfp);
+	if (!blk) {
+		return NULL;
+	}
+	
+	blk->mlen = mlen;
+	
+	for (i = 0; i < pages_num; i++) {
+		blk->pages[i] = alloc_page(gfp);
+		if (!blk->pages[i]) {
+			tmod_blk_free(blk);
+			return NULL;
+		}
+		blk->pages_num++;
+	}
+	
+	return blk;
+}
+
+void tmod_blk_free(struct tmod_blk *blk)
+{
+	unsigned int i;
+	
+	if (!blk) {
+		return;
+	}
+	
+	tmod_blk_free(blk->src);
+	mem_cgroup_put(blk->memcg);
+	
+	for (i = 0; i < blk->pages_num; i++) {
+		__free_page(blk->pages[i]);
+	}
+	
+	kvfree(blk);
+}
+
+/*
+ * Walk len bytes of two blocks in lockstep, their segments may differ.
+ * With copy set, a is copied into b, otherwise they are compared.
+ * Returns false on the first mismatch.
+ */
+static bool tmod_blk_pair(const struct tmod_blk *a, struct tmod_blk *b, size_t len, bool copy)
+{
+	struct tmod_blk_iter a_iter;
+	struct tmod_blk_iter b_iter;
+	size_t a_cut;
+	size_t cut;
+	char *a_seg;
+	char *b_seg;
+	
+	tmod_blk_iter_init(&a_iter, a, 0);
+	tmod_blk_iter_init(&b_iter, b, 0);
+	
+	while (len) {
+		a_seg = tmod_blk_iter_get(&a_iter, len, &a_cut);
+		b_seg = tmod_blk_iter_get(&b_iter, a_cut, &cut);
+		if (!cut) {
+			return false;
+		}
+		
+		if (copy) {
+			memcpy(b_seg, a_seg, cut);
+		} else if (memcmp(a_seg, b_seg, cut)) {
+			return false;
+		}
+		
+		tmod_blk_iter_advance(&a_iter, cut);
+		tmod_blk_iter_advance(&b_iter, cut);
+		len -= cut;
+	}
+	
+	return true;
+}
+
+struct tmod_blk *tmod_blk_dup(const struct tmod_blk *blk, gfp_t gfp)
+{
+	struct tmod_blk *dup;
+	
+	dup = tmod_blk_alloc(blk->len, gfp);
+	if (!dup) {
+		return NULL;
+	}
+	
+	tmod_blk_pair(blk, dup, blk->len, true);
+	dup->len = blk->len;
+	dup->crc_in = blk->crc_in;
+	dup->crc_out = blk->crc_out;
+	
+	return dup;
+}
+
+bool tmod_blk_equal(const struct tmod_blk *a, const struct tmod_blk *b)
+{
+	if (a->len != b->len) {
+		return false;
+	}
+	
+	/* Not modified when comparing */
+	return tmod_blk_pair(a, (struct tmod_blk *)b, a->len, false);
+}
+
+size_t tmod_blk_slab_size(size_t size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	return kmalloc_size_roundup(size);
+#else
+	/* Upper bound: kmalloc() size classes are powers of two or below */
+	return roundup_pow_of_two(size);
+#endif
+}
+
+size_t tmod_blk_size(size_t mlen)
+{
+	size_t pages_num;
+	
+	/* A single slab object: its whole size class is used */
+	if (mlen <= TMOD_BLK_INLINE_MAX) {
+		return tmod_blk_slab_size(sizeof(struct tmod_blk) + mlen);
+	}
+	
+	pages_num = DIV_ROUND_UP(mlen, PAGE_SIZE);
+	
+	return sizeof(struct tmod_blk) + pages_num * (sizeof(struct page *) + PAGE_SIZE);
+}
+
+size_t tmod_blk_mem(const struct tmod_blk *blk)
+{
+	size_t mem;
+	
+	mem = tmod_blk_size(blk->mlen);
+	if (blk->src) {
+		mem += tmod_blk_mem(blk->src);
+	}
+	
+	return mem;
+}
+
+unsigned int tmod_blk_segs(const struct tmod_blk *blk)
+{
+	return blk->pages_num ? blk->pages_num : 1;
+}
+
+char *tmod_blk_seg(const struct tmod_blk *blk, unsigned int idx, size_t *seg_len)
+{
+	if (!blk->pages_num) {
+		*seg_len = blk->mlen;
+		return blk->data;
+	}
+	
+	*seg_len = min_t(size_t, PAGE_SIZE, blk->mlen - (size_t)idx * PAGE_SIZE);
+	
+	/* Pages come from lowmem (no __GFP_HIGHMEM) */
+	return page_address(blk->pages[idx]);
+}
+
+void tmod_blk_iter_init(struct tmod_blk_iter *iter, const struct tmod_blk *blk, size_t pos)
+{
+	iter->blk = blk;
+	
+	/* Every page but the last is full */
+	if (blk->pages_num) {
+		iter->idx = pos / PAGE_SIZE;
+		iter->off = pos % PAGE_SIZE;
+	} else {
+		iter->idx = 0;
+		iter->off = pos;
+	}
+}
+
+char *tmod_blk_iter_get(const struct tmod_blk_iter *iter, size_t len, size_t *cut)
+{
+	size_t seg_len;
+	char *seg;
+	
+	*cut = 0;
+	if (iter->idx >= tmod_blk_segs(iter->blk)) {
+		return NULL;
+	}
+	
+	seg = tmod_blk_seg(iter->blk, iter->idx, &seg_len);
+	if (iter->off >= seg_len) {
+		return NULL;
+	}
+	
+	*cut = min(len, seg_len - iter->off);
+	
+	return seg + iter->off;
+}
+
+void tmod_blk_iter_advance(struct tmod_blk_iter *iter, size_t cut)
+{
+	size_t seg_len;
+	
+	tmod_blk_seg(iter->blk, iter->idx, &seg_len);
+	
+	iter->off += cut;
+	if (iter->off == seg_len) {
+		iter->idx++;
+		iter->off = 0;
+	}
+}
+
+void *tmod_blk_map(struct tmod_blk *blk)
+{
+	if (!blk->pages_num) {
+		return blk->data;
+	}
+	
+	return vmap(blk->pages, blk->pages_num, VM_MAP, PAGE_KERNEL);
+}
+
+void tmod_blk_unmap(struct tmod_blk *blk, void *addr)
+{
+	if (blk->pages_num && addr) {
+		vunmap(addr);
+	}
+}
+
+/*
+ * The one walk behind the copy helpers: len bytes from position pos of
+ * blk, to it (to_blk) or from it, and ubuf (userspace) or buf.
+ * Returns the number of bytes not copied.
+ */
+static size_t tmod_blk_copy(struct tmod_blk *blk, size_t pos, char __user *ubuf, char *buf,
+							size_t len, bool to_blk)
+{
+	struct tmod_blk_iter iter;
+	size_t cut;
+	char *seg;
+	
+	tmod_blk_iter_init(&iter, blk, pos);
+	
+	while (len) {
+		seg = tmod_blk_iter_get(&iter, len, &cut);
+		if (!cut) {
+			break;
+		}
+		
+		if (ubuf) {
+			if (to_blk ? copy_from_user(seg, ubuf, cut) : copy_to_user(ubuf, seg, cut)) {
+				break;
+			}
+			ubuf += cut;
+		} else {
+			if (to_blk) {
+				memcpy(seg, buf, cut);
+			} else {
+				memcpy(buf, seg, cut);
+			}
+			buf += cut;
+		}
+		
+		tmod_blk_iter_advance(&iter, cut);
+		len -= cut;
+	}
+	
+	return len;
+}
+
+/* The source side (ubuf, buf or blk) is never written */
+size_t tmod_blk_from_user(struct tmod_blk *blk, const char __user *ubuf, size_t len)
+{
+	return tmod_blk_copy(blk, 0, (char __user *)ubuf, NULL, len, true);
+}
+
+size_t tmod_blk_to_user(char __user *ubuf, const struct tmod_blk *blk, size_t len)
+{
+	return tmod_blk_copy((struct tmod_blk *)blk, 0, ubuf, NULL, len, false);
+}
+
+size_t tmod_blk_from_buf(struct tmod_blk *blk, const char *buf, size_t len)
+{
+	return tmod_blk_copy(blk, 0, NULL, (char *)buf, len, true);
+}
+
+size_t tmod_blk_to_buf(char *buf, const struct tmod_blk *blk, size_t len)
+{
+	return tmod_blk_copy((struct tmod_blk *)blk, 0, NULL, buf, len, false);
+}
+
+size_t tmod_blk_append_user(struct tmod_blk *blk, const char __user *ubuf, size_t len)
+{
+	size_t left;
+	
+	left = tmod_blk_copy(blk, blk->len, (char __user *)ubuf, NULL, len, true);
+	if (!left) {
+		blk->len += len;
+	}
+	
+	return left;
+}
+
+size_t tmod_blk_append_buf(struct tmod_blk *blk, const char *buf, size_t len)
+{
+	size_t left;
+	
+	left = tmod_blk_copy(blk, blk->len, NULL, (char *)buf, len, true);
+	if (!left) {
+		blk->len += len;
+	}
+	
+	return left;
+}
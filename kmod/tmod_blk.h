@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#ifndef TMOD_BLK_H
+#define TMOD_BLK_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+/* Block memory is charged to the memory cgroup of the writer */
+#define TMOD_BLK_GFP		(GFP_USER | __GFP_ACCOUNT)
+
+struct page;
+struct mem_cgroup;
+
+/*
+ * Block of data moving through the pipeline. Small blocks are stored
+ * inline after the header, larger ones in a vector of order-0 pages so
+ * that no block ever needs a high order allocation.
+ */
+struct tmod_blk {
+	size_t len;					/* data bytes */
+	size_t mlen;				/* capacity */
+	
+	/* CRC32C of the written block and of the output (tag mode) */
+	u32 crc_in;
+	u32 crc_out;
+	
+	/* Result cache: data is already the pipeline output */
+	bool cached;
+	/* Result cache: original input, carried to the last stage */
+	struct tmod_blk *src;
+	
+	/* Lost in a stage: the data is stale, read() returns err instead */
+	int err;
+	
+	/* Writer memory cgroup (reference), for allocations by the workers */
+	struct mem_cgroup *memcg;
+	
+	/* Link in a queue (tmod_buff), no allocation on push */
+	struct list_head q_node;
+	
+	/* Zero if the data is inline */
+	unsigned int pages_num;
+	char *data;
+	struct page *pages[];
+};
+
+struct tmod_blk *tmod_blk_alloc(size_t mlen, gfp_t gfp);
+void tmod_blk_free(struct tmod_blk *blk);
+
+/* Memory used by a kmalloc() of size bytes, with size class rounding */
+size_t tmod_blk_slab_size(size_t size);
+
+/* Memory used by a block of capacity mlen, and by blk (with src) */
+size_t tmod_blk_size(size_t mlen);
+size_t tmod_blk_mem(const struct tmod_blk *blk);
+
+/* Copy of data, length and checksums */
+struct tmod_blk *tmod_blk_dup(const struct tmod_blk *blk, gfp_t gfp);
+bool tmod_blk_equal(const struct tmod_blk *a, const struct tmod_blk *b);
+
+/* Number of segments and address/length of segment idx (capacity) */
+unsigned int tmod_blk_segs(const struct tmod_blk *blk);
+char *tmod_blk_seg(const struct tmod_blk *blk, unsigned int idx, size_t *seg_len);
+
+/*
+ * Cursor over the data of a block from byte pos, across its segments:
+ * get returns the contiguous bytes at the cursor (*cut of them, at most
+ * len, zero past the capacity), advance moves past cut of them.
+ */
+struct tmod_blk_iter {
+	const struct tmod_blk *blk;
+	unsigned int idx;
+	size_t off;
+};
+
+void tmod_blk_iter_init(struct tmod_blk_iter *iter, const struct tmod_blk *blk, size_t pos);
+char *tmod_blk_iter_get(const struct tmod_blk_iter *iter, size_t len, size_t *cut);
+void tmod_blk_iter_advance(struct tmod_blk_iter *iter, size_t cut);
+
+/* Contiguous view for library code, vmap() of the pages if needed */
+void *tmod_blk_map(struct tmod_blk *blk);
+void tmod_blk_unmap(struct tmod_blk *blk, void *addr);
+
+/* Copy helpers, return the number of bytes not copied (as copy_*_user) */
+size_t tmod_blk_from_user(struct tmod_blk *blk, const char __user *ubuf, size_t len);
+size_t tmod_blk_to_user(char __user *ubuf, const struct tmod_blk *blk, size_t len);
+size_t tmod_blk_from_buf(struct tmod_blk *blk, const char *buf, size_t len);
+size_t tmod_blk_to_buf(char *buf, const struct tmod_blk *blk, size_t len);
+
+/* Append after blk->len, which grows only if all len bytes are copied */
+size_t tmod_blk_append_user(struct tmod_blk *blk, const char __user *ubuf, size_t len);
+size_t tmod_blk_append_buf(struct tmod_blk *blk, const char *buf, size_t len);
+
+#endif /* TMOD_BLK_H */
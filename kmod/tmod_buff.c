@@ -11,21 +11,26 @@
 #include <linux/slab.h>
 #include <linux/list.h>
 
+#include "tmod_buff.h"
+#include "tmod_blk.h"
+
 struct tmod_buff {
 	size_t buff_mlen;
 	size_t buffs_mcount;
 	size_t buffs_count;
+	size_t mem_max;
+	size_t mem;
 	struct list_head buffs_head;
 };
 
-struct list_node {
-	char *data;
-	size_t length;
-	struct list_head list_nav;
-};
+/* Blocks are linked through blk->q_node: a push never allocates */
+size_t tmod_buff_blk_mem(size_t mlen)
+{
+	return tmod_blk_size(mlen);
+}
 
 int tmod_buff_init(struct tmod_buff **buff, const size_t buffs_mcount,
-					const size_t buff_mlen)
+					const size_t buff_mlen, const size_t mem_max)
 {
 	*buff = kzalloc(sizeof(**buff), GFP_KERNEL);
 	if (!(*buff)) {
@@ -36,6 +41,8 @@ int tmod_buff_init(struct tmod_buff **buff, const size_t buffs_mcount,
 	(*buff)->buff_mlen = buff_mlen;
 	(*buff)->buffs_mcount = buffs_mcount;
 	(*buff)->buffs_count = 0;
+	(*buff)->mem_max = mem_max;
+	(*buff)->mem = 0;
 	
 	/* Init list */
 	INIT_LIST_HEAD(&(*buff)->buffs_head);
@@ -47,45 +54,57 @@ void tmod_buff_destroy(struct tmod_buff *buff)
 {
 	/* list navs */
 	struct list_head *cursor, *tmp;
-	/* list node */
-	struct list_node *node;
+	/* queued block */
+	struct tmod_blk *blk;
 
-	/* Traverse and delete nodes in the list */
+	/* Traverse and delete blocks in the list */
 	list_for_each_safe(cursor, tmp, &buff->buffs_head) {
 		
-		/* Get node */
-		node = list_entry(cursor, struct list_node, list_nav); //HERE
+		/* Get block */
+		blk = list_entry(cursor, struct tmod_blk, q_node);
 		
 		/* delete node */
 		list_del(cursor);
 		
-		/* Delete node's internal data */
-		kfree(node);
+		tmod_blk_free(blk);
 	}
+	
+	kfree(buff);
 }
 
-size_t tmod_buff_push(struct tmod_buff *buff, const char *data, size_t length)
+bool tmod_buff_room_mem(const struct tmod_buff *buff, size_t mem)
 {
-	struct list_node *node;
-	
-	if (buff->buffs_count == buff->buffs_mcount || length > buff->buff_mlen) {
-		return 0;
+	if (!buff->buffs_count) {
+		return true;
 	}
 	
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
+	if (buff->buffs_mcount && buff->buffs_count >= buff->buffs_mcount) {
+		return false;
+	}
 	
-	node->data = (char *)data;
-	node->length = length;
+	return !buff->mem_max || buff->mem + mem <= buff->mem_max;
+}
+
+bool tmod_buff_room(const struct tmod_buff *buff, const struct tmod_blk *blk)
+{
+	return tmod_buff_room_mem(buff, tmod_blk_mem(blk));
+}
+
+size_t tmod_buff_push(struct tmod_buff *buff, struct tmod_blk *blk)
+{
+	if (!tmod_buff_room(buff, blk) || blk->len > buff->buff_mlen) {
+		return 0;
+	}
 	
-	list_add_tail(&node->list_nav, &buff->buffs_head);
+	list_add_tail(&blk->q_node, &buff->buffs_head);
 	buff->buffs_count++;
+	buff->mem += tmod_blk_mem(blk);
 
-	return length;
+	return blk->len;
 }
 
-size_t tmod_buff_pop(struct tmod_buff *buff, char **data)
+size_t tmod_buff_pop(struct tmod_buff *buff, struct tmod_blk **blk)
 {
-	struct list_node *node;
 	size_t length;
 	
 	if (!buff->buffs_count) {
@@ -94,15 +113,13 @@ size_t tmod_buff_pop(struct tmod_buff *buff, char **data)
 	
 	BUG_ON(list_empty(&buff->buffs_head));
 
-	/* Get first node (next to the head) */
-	node = list_entry(buff->buffs_head.next, struct list_node, list_nav);
-	
-	*data = node->data;
-	length = node->length;
+	/* Get first block (next to the head), unchanged since its push */
+	*blk = list_first_entry(&buff->buffs_head, struct tmod_blk, q_node);
+	length = (*blk)->len;
 	
-	list_del(buff->buffs_head.next);
+	list_del(&(*blk)->q_node);
 	buff->buffs_count--;
-	kfree(node);
+	buff->mem -= tmod_blk_mem(*blk);
 	
 	return length;
 }
@@ -11,15 +11,33 @@
 #ifndef TMOD_BUFF_H
 #define TMOD_BUFF_H
 
+#include <linux/types.h>
+
 struct tmod_buff;
+struct tmod_blk;
 
-int tmod_buff_init(struct tmod_buff **buff, const size_t buffs_count,
-					const size_t buff_len);
+/*
+ * Queue bounded by mem_max bytes of blocks (headers and pages),
+ * and optionally by buffs_mcount blocks. Zero disables either limit.
+ * An empty buffer always takes one block, whatever its size.
+ */
+int tmod_buff_init(struct tmod_buff **buff, const size_t buffs_mcount,
+					const size_t buff_mlen, const size_t mem_max);
 void tmod_buff_destroy(struct tmod_buff *buff);
 
-/* Push and pop returns the number of bytes or zero in case of error */
-size_t tmod_buff_push(struct tmod_buff *buff, const char *data, size_t length);
+/* Memory charged for a queued block of capacity mlen */
+size_t tmod_buff_blk_mem(size_t mlen);
+
+/* True if blk, or a block of mem bytes (see tmod_blk_mem()), can be pushed now */
+bool tmod_buff_room(const struct tmod_buff *buff, const struct tmod_blk *blk);
+bool tmod_buff_room_mem(const struct tmod_buff *buff, size_t mem);
+
+/*
+ * Push and pop returns the number of bytes or zero in case of error.
+ * A push only fails without room or for a block longer than buff_mlen.
+ */
+size_t tmod_buff_push(struct tmod_buff *buff, struct tmod_blk *blk);
 
-size_t tmod_buff_pop(struct tmod_buff *buff, char **data);
+size_t tmod_buff_pop(struct tmod_buff *buff, struct tmod_blk **blk);
 
 #endif /* TMOD_BUFF_H */
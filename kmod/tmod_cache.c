@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/mutex.h>
+#include <linux/crc32c.h>
+
+#include "tmod_blk.h"
+#include "tmod_cache.h"
+
+#define TMOD_CACHE_BITS		10
+
+struct tmod_cache_ent {
+	struct hlist_node hnode;
+	struct list_head lru;
+	u32 hash;
+	size_t mem;
+	struct tmod_blk *blk_in;
+	struct tmod_blk *blk_out;
+};
+
+struct tmod_cache {
+	struct mutex m_lock;
+	
+	DECLARE_HASHTABLE(table, TMOD_CACHE_BITS);
+	/* Most recently used first */
+	struct list_head lru;
+	
+	char key;
+	size_t mem;
+	size_t mem_max;
+	size_t entries;
+	
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+};
+
+/* Content hash seeded with the key, collisions are resolved by comparing data */
+static u32 tmod_cache_hash(const struct tmod_cache *cache, const struct tmod_blk *blk)
+{
+	struct tmod_blk_iter iter;
+	size_t left;
+	size_t cut;
+	u32 hash;
+	char *seg;
+	
+	hash = crc32c((u32)(unsigned char)cache->key, &blk->len, sizeof(blk->len));
+	
+	tmod_blk_iter_init(&iter, blk, 0);
+	for (left = blk->len; left; left -= cut) {
+		seg = tmod_blk_iter_get(&iter, left, &cut);
+		if (!cut) {
+			break;
+		}
+		
+		hash = crc32c(hash, seg, cut);
+		tmod_blk_iter_advance(&iter, cut);
+	}
+	
+	return hash;
+}
+
+/* Called with the lock held */
+static struct tmod_cache_ent *tmod_cache_find(struct tmod_cache *cache,
+												const struct tmod_blk *blk_in, u32 hash)
+{
+	struct tmod_cache_ent *ent;
+	
+	hash_for_each_possible(cache->table, ent, hnode, hash) {
+		if (ent->hash == hash && tmod_blk_equal(ent->blk_in, blk_in)) {
+			return ent;
+		}
+	}
+	
+	return NULL;
+}
+
+/* Called with the lock held */
+static void tmod_cache_evict(struct tmod_cache *cache, struct tmod_cache_ent *ent)
+{
+	hash_del(&ent->hnode);
+	list_del(&ent->lru);
+	
+	cache->mem -= ent->mem;
+	cache->entries--;
+	
+	tmod_blk_free(ent->blk_in);
+	tmod_blk_free(ent->blk_out);
+	kfree(ent);
+}
+
+int tmod_cache_init(struct tmod_cache **cache, size_t mem_max, char key)
+{
+	*cache = kzalloc(sizeof(**cache), GFP_KERNEL);
+	if (!(*cache)) {
+		printk(KERN_ALERT "tmod: could not allocate memory for the cache\n");
+		return -ENOMEM;
+	}
+	
+	mutex_init(&(*cache)->m_lock);
+	hash_init((*cache)->table);
+	INIT_LIST_HEAD(&(*cache)->lru);
+	
+	(*cache)->key = key;
+	(*cache)->mem_max = mem_max;
+	
+	return 0;
+}
+
+void tmod_cache_destroy(struct tmod_cache *cache)
+{
+	struct tmod_cache_ent *ent, *tmp;
+	
+	if (!cache) {
+		return;
+	}
+	
+	list_for_each_entry_safe(ent, tmp, &cache->lru, lru) {
+		tmod_cache_evict(cache, ent);
+	}
+	
+	mutex_destroy(&cache->m_lock);
+	kfree(cache);
+}
+
+struct tmod_blk *tmod_cache_lookup(struct tmod_cache *cache, const struct tmod_blk *blk_in)
+{
+	struct tmod_cache_ent *ent;
+	struct tmod_blk *blk_out = NULL;
+	u32 hash;
+	
+	hash = tmod_cache_hash(cache, blk_in);
+	
+	mutex_lock(&cache->m_lock);
+	
+	ent = tmod_cache_find(cache, blk_in, hash);
+	if (ent) {
+		list_move(&ent->lru, &cache->lru);
+		blk_out = tmod_blk_dup(ent->blk_out, TMOD_BLK_GFP);
+	}
+	
+	/* A failed copy counts as a miss, the block takes the slow path */
+	if (blk_out) {
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+	
+	mutex_unlock(&cache->m_lock);
+	
+	return blk_out;
+}
+
+void tmod_cache_insert(struct tmod_cache *cache, const struct tmod_blk *blk_in,
+						const struct tmod_blk *blk_out)
+{
+	struct tmod_cache_ent *ent;
+	size_t mem;
+	u32 hash;
+	
+	/* Real footprint of the copies: page rounding and page vectors included */
+	mem = tmod_blk_slab_size(sizeof(*ent)) + tmod_blk_size(blk_in->len) +
+			tmod_blk_size(blk_out->len);
+	if (mem > cache->mem_max) {
+		return;
+	}
+	
+	hash = tmod_cache_hash(cache, blk_in);
+	
+	/*
+	 * Shared by every writer and bounded by mem_max: not charged to the
+	 * memory cgroup of the one that missed first (active in the worker)
+	 */
+	ent = kzalloc(sizeof(*ent), GFP_KERNEL);
+	if (ent) {
+		ent->blk_in = tmod_blk_dup(blk_in, GFP_KERNEL);
+		ent->blk_out = tmod_blk_dup(blk_out, GFP_KERNEL);
+	}
+	if (!ent || !ent->blk_in || !ent->blk_out) {
+		if (ent) {
+			tmod_blk_free(ent->blk_in);
+			tmod_blk_free(ent->blk_out);
+		}
+		kfree(ent);
+		return;
+	}
+	
+	ent->hash = hash;
+	ent->mem = mem;
+	
+	mutex_lock(&cache->m_lock);
+	
+	/* Same block missed twice while in flight: keep the first */
+	if (tmod_cache_find(cache, blk_in, hash)) {
+		mutex_unlock(&cache->m_lock);
+		tmod_blk_free(ent->blk_in);
+		tmod_blk_free(ent->blk_out);
+		kfree(ent);
+		return;
+	}
+	
+	/* Make room from the least recently used end */
+	while (cache->mem + mem > cache->mem_max) {
+		tmod_cache_evict(cache, list_last_entry(&cache->lru, struct tmod_cache_ent, lru));
+		cache->evictions++;
+	}
+	
+	hash_add(cache->table, &ent->hnode, hash);
+	list_add(&ent->lru, &cache->lru);
+	cache->mem += mem;
+	cache->entries++;
+	
+	mutex_unlock(&cache->m_lock);
+}
+
+void tmod_cache_get_stats(struct tmod_cache *cache, struct tmod_cache_stats *stats)
+{
+	mutex_lock(&cache->m_lock);
+	
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	stats->entries = cache->entries;
+	stats->mem = cache->mem;
+	
+	mutex_unlock(&cache->m_lock);
+}
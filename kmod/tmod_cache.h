@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#ifndef TMOD_CACHE_H
+#define TMOD_CACHE_H
+
+#include <linux/types.h>
+
+struct tmod_cache;
+struct tmod_blk;
+
+struct tmod_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	size_t entries;
+	size_t mem;
+};
+
+/*
+ * Bounded LRU cache of pipeline results, keyed by the XOR key and the
+ * input block content. At most mem_max bytes of blocks are kept.
+ */
+int tmod_cache_init(struct tmod_cache **cache, size_t mem_max, char key);
+void tmod_cache_destroy(struct tmod_cache *cache);
+
+/* Copy of the cached output for blk_in (a hit), or NULL (a miss) */
+struct tmod_blk *tmod_cache_lookup(struct tmod_cache *cache, const struct tmod_blk *blk_in);
+
+/* Store the output of blk_in: copies both, not charged to any memory cgroup */
+void tmod_cache_insert(struct tmod_cache *cache, const struct tmod_blk *blk_in,
+						const struct tmod_blk *blk_out);
+
+void tmod_cache_get_stats(struct tmod_cache *cache, struct tmod_cache_stats *stats);
+
+#endif /* TMOD_CACHE_H */
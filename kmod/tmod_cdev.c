@@ -13,45 +13,673 @@
 #include <linux/miscdevice.h>
 #include <linux/cdev.h>				/* cdev utils */
 #include <linux/slab.h>				/* kmalloc */
+#include <linux/string.h>			/* strsep */
 #include <linux/mutex.h>
 #include <linux/kthread.h>
+#include <linux/sched.h>			/* need_resched, signal_pending */
+#include <linux/ktime.h>
+#include <linux/device.h>			/* device attributes */
+#include <linux/memcontrol.h>		/* get_mem_cgroup_from_mm */
+#include <linux/sched/mm.h>			/* set_active_memcg */
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
 
+#include "tmod_blk.h"
 #include "tmod_buff.h"
-#include "tmod_worker.h"
+#include "tmod_cache.h"
+#include "tmod_cdev.h"
+#include "tmod_stage.h"
+#include "tmod_uapi.h"
 
-/* Context */
-struct cdev_ctx {
+/* Queue between two steps of the pipeline, bounded in bytes (see tmod_buff.h) */
+struct tmod_queue {
 	struct mutex m_lock;
 	
+	struct tmod_buff *buff;
+	size_t blk_mlen;
+	
+	/* Wait queues + associated state variable */
+	wait_queue_head_t not_full;
+	wait_queue_head_t not_empty;
+	unsigned int blks;
+	
+	/* Adaptive busy polling before sleeping on not_empty, off if zero */
+	u64 poll_ns_max;
+	u64 arrival_last;			/* time of the last push */
+	u64 arrival_avg;			/* moving average of the inter-arrival time */
+};
+
+/* Weight of the last sample in the inter-arrival average (1 / 2^shift) */
+#define TMOD_POLL_AVG_SHIFT		3
+
+/* Pipeline stage: one worker thread moving blocks between two queues */
+struct tmod_stage_wrk {
+	struct cdev_ctx *ctx;
+	struct tmod_stage stage;
+	
+	struct tmod_queue *q_in;
+	struct tmod_queue *q_out;
+	
+	/* Record checksums: of the written block (first), of the output (last) */
+	bool tag_in;
+	bool tag_out;
+	
+	/* Worker thread */
+	struct task_struct *worker_p;
+};
+
+/* Context */
+struct cdev_ctx {
 	/* Misc device */
 	struct miscdevice msc_cdev;
 	
 	/* Count users */
 	atomic_t users_cnt_a;
 	
-	/* Worker thread */
-	struct task_struct *worker_p;
-	
-	/* Buffer components */
-	struct tmod_buff *buff_in;
-	struct tmod_buff *buff_out;
+	/*
+	 * Pipeline: write() feeds queues[0], stage i moves blocks from
+	 * queues[i] to queues[i + 1], read() drains queues[stages_num]
+	 */
+	struct tmod_queue queues[TMOD_STAGES_MAX + 1];
+	struct tmod_stage_wrk stages[TMOD_STAGES_MAX];
+	size_t stages_num;
 	
 	/* Parameters */
 	size_t blk_mlen;
 	size_t blk_mnum;
 	char key;
+	bool tag;
 	
-	/* Wait queues + associated state variable for input buffer */
-	wait_queue_head_t blks_in_not_full;
-	wait_queue_head_t blks_in_not_empty;
-	unsigned int blks_in;
+	/* Blocks written and not yet read */
+	atomic_t blks_inflight;
 	
-	/* Wait queues + associated state variable for output buffer */
-	wait_queue_head_t blks_out_not_full;
-	wait_queue_head_t blks_out_not_empty;
-	unsigned int blks_out;
+	/* Result cache, NULL if off */
+	struct tmod_cache *cache;
+	/* Longest result fitting every queue */
+	size_t cache_len_max;
+	
+	/* Coalescing of small writes, off if co_ns is zero */
+	u64 co_ns;
+	struct mutex co_lock;
+	struct tmod_blk *co_blk;	/* staging block, NULL if none */
+	u64 co_start;				/* time of the staging block creation */
+	struct hrtimer co_timer;
+	struct work_struct co_work;	/* timeout dispatch, in process context */
+	bool co_stop;				/* no more timeouts on destroy */
 };
 
+/*----------------------------- Queues -------------------------------*/
+
+static int tmod_queue_init(struct tmod_queue *q, size_t blk_slots, size_t blk_mlen,
+							size_t mem_max, u64 poll_ns_max)
+{
+	int retval;
+	
+	retval = tmod_buff_init(&q->buff, blk_slots, blk_mlen, mem_max);
+	if (retval < 0) {
+		printk(KERN_ERR "tmod: unable to initialize the buffer dev\n");
+		return retval;
+	}
+	
+	mutex_init(&q->m_lock);
+	
+	q->blk_mlen = blk_mlen;
+	q->blks = 0;
+	
+	/* Start optimistic: spin the whole budget until arrivals are sampled */
+	q->poll_ns_max = poll_ns_max;
+	q->arrival_last = 0;
+	q->arrival_avg = poll_ns_max;
+	
+	init_waitqueue_head(&q->not_full);
+	init_waitqueue_head(&q->not_empty);
+	
+	return 0;
+}
+
+static void tmod_queue_destroy(struct tmod_queue *q)
+{
+	if (!q->buff) {
+		return;
+	}
+	
+	mutex_destroy(&q->m_lock);
+	tmod_buff_destroy(q->buff);
+	q->buff = NULL;
+}
+
+/* Writers and readers are never asked to stop, only workers are */
+static bool tmod_should_stop(void)
+{
+	return (current->flags & PF_KTHREAD) && kthread_should_stop();
+}
+
+/*
+ * Fold an inter-arrival gap into the moving average. A gap only tells
+ * that spinning would not have paid off, so it is capped at twice the
+ * poll cap: after an idle pause a burst is back to spinning within a
+ * few arrivals, instead of tens of them.
+*/
+u64 tmod_cdev_poll_avg(u64 avg, u64 gap, u64 poll_ns_max)
+{
+	gap = min(gap, 2 * poll_ns_max);
+	
+	avg -= avg >> TMOD_POLL_AVG_SHIFT;
+	avg += gap >> TMOD_POLL_AVG_SHIFT;
+	
+	return avg;
+}
+
+/* Spin for up to twice the average, capped, or not at all if slower than the cap */
+u64 tmod_cdev_poll_budget(u64 avg, u64 poll_ns_max)
+{
+	if (avg > poll_ns_max) {
+		return 0;
+	}
+	
+	return min(2 * avg, poll_ns_max);
+}
+
+/* Sample the inter-arrival time, called with the queue lock held */
+static void tmod_queue_arrival(struct tmod_queue *q)
+{
+	u64 now;
+	
+	if (!q->poll_ns_max) {
+		return;
+	}
+	
+	now = ktime_get_ns();
+	if (q->arrival_last) {
+		WRITE_ONCE(q->arrival_avg, tmod_cdev_poll_avg(q->arrival_avg, now - q->arrival_last,
+													q->poll_ns_max));
+	}
+	q->arrival_last = now;
+}
+
+/*
+ * NAPI-like busy polling: spin on the block counter for up to twice the
+ * average inter-arrival time, capped by poll_ns_max. If blocks arrive
+ * slower than the cap, sleeping is cheaper and no spin happens.
+ * Returns true if a block showed up (or there is nothing left to wait for).
+*/
+static bool tmod_queue_poll(struct tmod_queue *q, atomic_t *inflight)
+{
+	u64 budget;
+	u64 start;
+	
+	if (!q->poll_ns_max) {
+		return false;
+	}
+	
+	budget = tmod_cdev_poll_budget(READ_ONCE(q->arrival_avg), q->poll_ns_max);
+	if (!budget) {
+		return false;
+	}
+	
+	start = ktime_get_ns();
+	while (!READ_ONCE(q->blks)) {
+		if (inflight && !atomic_read(inflight)) {
+			return true;
+		}
+		if (ktime_get_ns() - start > budget || need_resched() ||
+			signal_pending(current) || tmod_should_stop()) {
+			return false;
+		}
+		cpu_relax();
+	}
+	
+	return true;
+}
+
+/* Peek at the room for blk, a later push may still wait or fail */
+static bool tmod_queue_room(struct tmod_queue *q, const struct tmod_blk *blk)
+{
+	bool room;
+	
+	mutex_lock(&q->m_lock);
+	room = tmod_buff_room(q->buff, blk);
+	mutex_unlock(&q->m_lock);
+	
+	return room;
+}
+
+/*
+ * Push a block, waiting while the queue has no room for it (unless nowait).
+ * Returns 0, -EAGAIN if nowait and no room, -EINVAL if blk is too long,
+ * -ERESTARTSYS if interrupted or -EINTR if the worker must stop.
+*/
+static int tmod_queue_push(struct tmod_queue *q, struct tmod_blk *blk, bool nowait)
+{
+	size_t retval;
+	
+	mutex_lock(&q->m_lock);
+	while (!tmod_buff_room(q->buff, blk)) {
+		mutex_unlock(&q->m_lock);
+		if (nowait) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(q->not_full,
+									tmod_buff_room(q->buff, blk) || tmod_should_stop())) {
+			/* if woken up by a signal return */
+			printk(KERN_INFO "tmod: proc %u interrupted up by a signal"
+					" while waiting in write()\n", (unsigned)current->pid);
+			return -ERESTARTSYS;
+		}
+		if (tmod_should_stop()) {
+			return -EINTR;
+		}
+		mutex_lock(&q->m_lock);
+	}
+	
+	/* Push message, the block links itself: only a bad length fails */
+	retval = tmod_buff_push(q->buff, blk);
+	if (!retval) {
+		mutex_unlock(&q->m_lock);
+		printk(KERN_ERR "tmod: block of %zu bytes too long for the queue\n", blk->len);
+		return -EINVAL;
+	}
+	
+	tmod_queue_arrival(q);
+	
+	/* Increment status variable associated with the wait queue and "signal" */
+	q->blks++;
+	wake_up_interruptible(&q->not_empty);
+	
+	mutex_unlock(&q->m_lock);
+	
+	return 0;
+}
+
+/*
+ * Pop a block, waiting while the queue is empty. If inflight is given,
+ * returns zero instead of waiting when it drops to zero.
+ * Returns the block length, -ERESTARTSYS if interrupted or -EINTR if
+ * the worker must stop.
+*/
+static ssize_t tmod_queue_pop(struct tmod_queue *q, struct tmod_blk **blk, atomic_t *inflight)
+{
+	size_t retval;
+	
+	mutex_lock(&q->m_lock);
+	while (q->blks == 0) {
+		/* If no blocks have been submitted return (avoid cat to wait indefinitely) */
+		if (inflight && !atomic_read(inflight)) {
+			mutex_unlock(&q->m_lock);
+			return 0;
+		}
+		
+		mutex_unlock(&q->m_lock);
+		
+		/* Next block expected soon: spin instead of paying a sleep/wakeup */
+		if (tmod_queue_poll(q, inflight)) {
+			mutex_lock(&q->m_lock);
+			continue;
+		}
+		
+		if (wait_event_interruptible(q->not_empty, (q->blks > 0) || tmod_should_stop() ||
+									(inflight && !atomic_read(inflight)))) {
+			/* if woken up by a signal return */
+			printk(KERN_INFO "tmod: proc %u interrupted up by a signal"
+					" while waiting in read()\n", (unsigned)current->pid);
+			return -ERESTARTSYS;
+		}
+		if (tmod_should_stop()) {
+			return -EINTR;
+		}
+		mutex_lock(&q->m_lock);
+	}
+	
+	/* Get message from the buffer */
+	retval = tmod_buff_pop(q->buff, blk);
+	BUG_ON(!retval);
+	
+	q->blks--;
+	wake_up_interruptible(&q->not_full);
+	
+	mutex_unlock(&q->m_lock);
+	
+	return (ssize_t)retval;
+}
+
+/*---------------------------- Pipeline ------------------------------*/
+
+/* A block will never reach the output queue: let readers re-check */
+static void tmod_cdev_drop(struct cdev_ctx *ctx)
+{
+	atomic_dec(&ctx->blks_inflight);
+	wake_up_interruptible(&ctx->queues[ctx->stages_num].not_empty);
+}
+
+/* Push a block into the first queue, on success the context owns blk */
+static int tmod_cdev_queue(struct cdev_ctx *ctx, struct tmod_blk *blk, bool nowait)
+{
+	int retval;
+	struct tmod_blk *hit = NULL;
+	
+	/*
+	 * A staged block is retried on every write, flush and timeout while
+	 * the queue is full: look it up only once it fits, so that retries
+	 * neither hash it again nor count as cache hits or misses.
+	 */
+	if (nowait && !tmod_queue_room(&ctx->queues[0], blk)) {
+		return -EAGAIN;
+	}
+	
+	/*
+	 * Known block: queue its cached result, the stages just forward it.
+	 * Going through the queues keeps the blocks in write order.
+	 */
+	if (ctx->cache) {
+		hit = tmod_cache_lookup(ctx->cache, blk);
+		if (hit) {
+			hit->cached = true;
+			hit->memcg = blk->memcg;
+			blk->memcg = NULL;
+		}
+	}
+	
+	atomic_inc(&ctx->blks_inflight);
+	
+	retval = tmod_queue_push(&ctx->queues[0], hit ? hit : blk, nowait);
+	if (retval) {
+		if (hit) {
+			blk->memcg = hit->memcg;
+			hit->memcg = NULL;
+			tmod_blk_free(hit);
+		}
+		tmod_cdev_drop(ctx);
+		return retval;
+	}
+	
+	/* The cached copy went in place of blk */
+	if (hit) {
+		tmod_blk_free(blk);
+	}
+	
+	return 0;
+}
+
+/*
+ * Pop a processed block from the last queue, waiting while it is empty.
+ * Returns the block length, zero if no blocks are in flight, -EIO if
+ * the next block was lost in a stage or -ERESTARTSYS if interrupted.
+ * On success the caller owns (and frees) *blk.
+ * In tag mode blk->crc_in and blk->crc_out hold the record checksums.
+*/
+ssize_t tmod_cdev_collect(struct cdev_ctx *ctx, struct tmod_blk **blk)
+{
+	ssize_t retval;
+	
+	retval = tmod_queue_pop(&ctx->queues[ctx->stages_num], blk, &ctx->blks_inflight);
+	if (retval > 0) {
+		atomic_dec(&ctx->blks_inflight);
+		
+		/* Lost in a stage: report it in place of its data */
+		if ((*blk)->err) {
+			retval = (*blk)->err;
+			tmod_blk_free(*blk);
+		}
+	}
+	
+	return retval;
+}
+
+/*
+ * Push a block into the first queue, waiting while it is full.
+ * On success the context takes ownership of blk.
+*/
+int tmod_cdev_submit(struct cdev_ctx *ctx, struct tmod_blk *blk)
+{
+	return tmod_cdev_queue(ctx, blk, false);
+}
+
+int tmod_cdev_cache_stats(struct cdev_ctx *ctx, struct tmod_cache_stats *stats)
+{
+	if (!ctx->cache) {
+		return -ENODEV;
+	}
+	
+	tmod_cache_get_stats(ctx->cache, stats);
+	
+	return 0;
+}
+
+/*---------------------------- Coalescing ----------------------------*/
+
+/*
+ * A timeout or flush may dispatch a few bytes in a block of blk_mlen:
+ * copy them to a block of their size first, so that the queue budget
+ * and the result cache are charged what is used. A failed copy just
+ * keeps the full capacity.
+*/
+static void tmod_cdev_co_shrink(struct cdev_ctx *ctx)
+{
+	struct tmod_blk *blk;
+	
+	if (tmod_blk_size(ctx->co_blk->len) > tmod_blk_size(ctx->co_blk->mlen) / 2) {
+		return;
+	}
+	
+	blk = tmod_blk_dup(ctx->co_blk, TMOD_BLK_GFP);
+	if (!blk) {
+		return;
+	}
+	
+	blk->memcg = ctx->co_blk->memcg;
+	ctx->co_blk->memcg = NULL;
+	tmod_blk_free(ctx->co_blk);
+	ctx->co_blk = blk;
+}
+
+/*
+ * Queue the staging block without waiting, called with co_lock held:
+ * co_lock is never held while waiting on a queue, so read() and flush
+ * always get it. Returns 0 (also if nothing is staged) or -EAGAIN if
+ * the first queue is full; *mem is then the room to wait for.
+*/
+static int tmod_cdev_co_dispatch(struct cdev_ctx *ctx, size_t *mem)
+{
+	int retval;
+	
+	if (!ctx->co_blk || !ctx->co_blk->len) {
+		return 0;
+	}
+	
+	tmod_cdev_co_shrink(ctx);
+	
+	retval = tmod_cdev_queue(ctx, ctx->co_blk, true);
+	if (retval) {
+		/* Still staged: retried by the next write, flush or timeout */
+		if (mem) {
+			*mem = tmod_blk_mem(ctx->co_blk);
+		}
+		hrtimer_start(&ctx->co_timer, ns_to_ktime(ctx->co_ns), HRTIMER_MODE_REL);
+		return retval;
+	}
+	
+	ctx->co_blk = NULL;
+	hrtimer_try_to_cancel(&ctx->co_timer);
+	
+	return 0;
+}
+
+/* Wait for room for mem bytes in the first queue, called without co_lock */
+static int tmod_cdev_co_wait(struct cdev_ctx *ctx, size_t mem)
+{
+	struct tmod_queue *q = &ctx->queues[0];
+	
+	if (wait_event_interruptible(q->not_full, tmod_buff_room_mem(q->buff, mem))) {
+		return -ERESTARTSYS;
+	}
+	
+	return 0;
+}
+
+/* Append len bytes from ubuf (userspace) or buf to the staging block */
+static ssize_t tmod_cdev_co_append(struct cdev_ctx *ctx, const char __user *ubuf,
+									const char *buf, size_t len)
+{
+	ssize_t retval;
+	size_t left;
+	size_t mem;
+	struct tmod_blk *blk;
+	
+	for (;;) {
+		if (mutex_lock_interruptible(&ctx->co_lock)) {
+			return -ERESTARTSYS;
+		}
+		
+		/* No room left (or shrunk): dispatch the staged bytes first, the order is kept */
+		if (!ctx->co_blk || ctx->co_blk->len + len <= ctx->co_blk->mlen) {
+			break;
+		}
+		retval = tmod_cdev_co_dispatch(ctx, &mem);
+		if (retval != -EAGAIN) {
+			if (retval) {
+				goto out;
+			}
+			break;
+		}
+		mutex_unlock(&ctx->co_lock);
+		
+		/* The staged bytes stay first in line while waiting */
+		retval = tmod_cdev_co_wait(ctx, mem);
+		if (retval) {
+			return retval;
+		}
+	}
+	
+	if (!ctx->co_blk) {
+		blk = tmod_blk_alloc(ctx->blk_mlen, TMOD_BLK_GFP);
+		if (!blk) {
+			printk(KERN_ERR "tmod: unable to allocate mem in write\n");
+			retval = -ENOMEM;
+			goto out;
+		}
+		blk->memcg = get_mem_cgroup_from_mm(current->mm);
+		
+		ctx->co_blk = blk;
+		ctx->co_start = ktime_get_ns();
+		
+		/* A full size write is dispatched right below */
+		if (len < ctx->blk_mlen) {
+			hrtimer_start(&ctx->co_timer, ns_to_ktime(ctx->co_ns), HRTIMER_MODE_REL);
+		}
+	}
+	
+	if (ubuf) {
+		left = tmod_blk_append_user(ctx->co_blk, ubuf, len);
+	} else {
+		left = tmod_blk_append_buf(ctx->co_blk, buf, len);
+	}
+	if (left) {
+		printk(KERN_ERR "tmod: copy_from_user failed\n");
+		if (!ctx->co_blk->len) {
+			hrtimer_try_to_cancel(&ctx->co_timer);
+			tmod_blk_free(ctx->co_blk);
+			ctx->co_blk = NULL;
+		}
+		retval = -EFAULT;
+		goto out;
+	}
+	
+	/*
+	 * The bytes are taken anyway. If the queue is full the block stays
+	 * staged: the next write waits for room, or the timer retries.
+	 */
+	if (ctx->co_blk->len == ctx->blk_mlen) {
+		tmod_cdev_co_dispatch(ctx, NULL);
+	}
+	retval = (ssize_t)len;
+	
+out:
+	mutex_unlock(&ctx->co_lock);
+	
+	return retval;
+}
+
+static void tmod_cdev_co_work(struct work_struct *work)
+{
+	u64 age;
+	struct cdev_ctx *ctx;
+	struct mem_cgroup *old_memcg;
+	
+	ctx = container_of(work, struct cdev_ctx, co_work);
+	
+	/* A writer is appending: check again later */
+	if (!mutex_trylock(&ctx->co_lock)) {
+		hrtimer_start(&ctx->co_timer, ns_to_ktime(ctx->co_ns), HRTIMER_MODE_REL);
+		return;
+	}
+	
+	if (ctx->co_blk) {
+		age = ktime_get_ns() - ctx->co_start;
+		if (age < ctx->co_ns) {
+			/* Late timeout of a block dispatched since: wait for this one */
+			hrtimer_start(&ctx->co_timer, ns_to_ktime(ctx->co_ns - age), HRTIMER_MODE_REL);
+		} else {
+			/* A full queue re-arms the timer */
+			old_memcg = set_active_memcg(ctx->co_blk->memcg);
+			tmod_cdev_co_dispatch(ctx, NULL);
+			set_active_memcg(old_memcg);
+		}
+	}
+	
+	mutex_unlock(&ctx->co_lock);
+}
+
+static enum hrtimer_restart tmod_cdev_co_timer(struct hrtimer *timer)
+{
+	struct cdev_ctx *ctx;
+	
+	/* Hard irq context: the dispatch may sleep */
+	ctx = container_of(timer, struct cdev_ctx, co_timer);
+	if (!READ_ONCE(ctx->co_stop)) {
+		queue_work(system_long_wq, &ctx->co_work);
+	}
+	
+	return HRTIMER_NORESTART;
+}
+
+ssize_t tmod_cdev_coalesce(struct cdev_ctx *ctx, const char *buf, size_t len)
+{
+	if (!ctx->co_ns || !len || len > ctx->blk_mlen) {
+		return -EINVAL;
+	}
+	
+	return tmod_cdev_co_append(ctx, NULL, buf, len);
+}
+
+/* Dispatch the staged bytes now, waiting (without co_lock) while the first queue is full */
+int tmod_cdev_flush(struct cdev_ctx *ctx)
+{
+	int retval;
+	size_t mem;
+	
+	if (!ctx->co_ns) {
+		return 0;
+	}
+	
+	for (;;) {
+		if (mutex_lock_interruptible(&ctx->co_lock)) {
+			return -ERESTARTSYS;
+		}
+		retval = tmod_cdev_co_dispatch(ctx, &mem);
+		mutex_unlock(&ctx->co_lock);
+		
+		if (retval != -EAGAIN) {
+			return retval;
+		}
+		
+		retval = tmod_cdev_co_wait(ctx, mem);
+		if (retval) {
+			return retval;
+		}
+	}
+}
+
 /*--------------------------- Char Device ----------------------------*/
 
 /* 
@@ -60,9 +688,11 @@ struct cdev_ctx {
 */
 static ssize_t cdev_read(struct file *file, char __user *ubuf, size_t len, loff_t *off)
 {
-	size_t retval;
+	ssize_t blk_len;
+	size_t hdr_cut = 0;
 	size_t len_cut;
-	char *blk;
+	struct tmod_rec_hdr hdr;
+	struct tmod_blk *blk;
 	struct cdev_ctx *ctx;
 	struct miscdevice *misc_dev;
 	
@@ -75,52 +705,56 @@ static ssize_t cdev_read(struct file *file, char __user *ubuf, size_t len, loff_
 	misc_dev = file->private_data;
 	ctx = container_of(misc_dev, struct cdev_ctx, msc_cdev);
 	
-	/* Check if messages are available in the output buffer */
-	mutex_lock(&ctx->m_lock);
-	while (ctx->blks_out == 0) {
-		/* If no blocks have been submitted return (avoid cat to wait indefinitely) */
-		if (ctx->blks_in == 0) {
-			mutex_unlock(&ctx->m_lock);
-			return 0;
-		}
-		
-		mutex_unlock(&ctx->m_lock);
-		if (wait_event_interruptible(ctx->blks_out_not_empty, (ctx->blks_out > 0))) {
-			/* if woken up by a signal return */
-			printk(KERN_INFO "tmod: proc %u interrupted up by a signal"
-					" while waiting in read()\n", (unsigned)current->pid);
+	/*
+	 * Staged bytes only: do not report EOF, hand them over now. Nothing
+	 * is in flight, so the first queue is empty and takes the block.
+	 */
+	if (ctx->co_ns && !atomic_read(&ctx->blks_inflight)) {
+		if (mutex_lock_interruptible(&ctx->co_lock)) {
 			return -ERESTARTSYS;
 		}
-		mutex_lock(&ctx->m_lock);
+		tmod_cdev_co_dispatch(ctx, NULL);
+		mutex_unlock(&ctx->co_lock);
 	}
 	
-	/* Get message from the buffer */
-	retval = tmod_buff_pop(ctx->buff_out, &blk);
-	BUG_ON(!retval);
-	
-	ctx->blks_out--;
-	wake_up_interruptible(&ctx->blks_out_not_full);
+	blk_len = tmod_cdev_collect(ctx, &blk);
+	if (blk_len <= 0) {
+		return blk_len;
+	}
 	
-	mutex_unlock(&ctx->m_lock);
+	/* Record header first in tag mode */
+	if (ctx->tag) {
+		hdr.len = blk->len;
+		hdr.crc_in = blk->crc_in;
+		hdr.crc_out = blk->crc_out;
+		
+		hdr_cut = min(len, sizeof(hdr));
+		if (copy_to_user(ubuf, &hdr, hdr_cut)) {
+			printk(KERN_ERR "tmod: copy_to_user failed\n");
+			tmod_blk_free(blk);
+			return -EFAULT;
+		}
+		ubuf += hdr_cut;
+		len -= hdr_cut;
+	}
 	
 	/* Copy the message back into the userspace buffer */
-	len_cut = len > retval ? retval : len;
-	retval = copy_to_user(ubuf, blk, len_cut);
-	if (retval) {
+	len_cut = len > (size_t)blk_len ? (size_t)blk_len : len;
+	if (tmod_blk_to_user(ubuf, blk, len_cut)) {
 		printk(KERN_ERR "tmod: copy_to_user failed\n");
-		kfree(blk);
+		tmod_blk_free(blk);
 		return -EFAULT;
 	}
 	
-	kfree(blk);
-	return (ssize_t)len_cut;
+	tmod_blk_free(blk);
+	return (ssize_t)(hdr_cut + len_cut);
 }
 
 static ssize_t cdev_write(struct file *file, const char __user *ubuf, size_t len, loff_t *off)
 {
-	size_t retval;
+	int retval;
 	size_t len_cut;
-	char *blk;
+	struct tmod_blk *blk;
 	struct cdev_ctx *ctx;
 	struct miscdevice *misc_dev;
 	
@@ -139,43 +773,52 @@ static ssize_t cdev_write(struct file *file, const char __user *ubuf, size_t len
 	 * of user process is limited to one by a counter
 	*/
 	len_cut = len > ctx->blk_mlen ? ctx->blk_mlen : len;
-	blk = kzalloc(len_cut, GFP_USER);
+	
+	/* Appended to the staging block, full size writes just fill it */
+	if (ctx->co_ns) {
+		return tmod_cdev_co_append(ctx, ubuf, NULL, len_cut);
+	}
+	
+	blk = tmod_blk_alloc(len_cut, TMOD_BLK_GFP);
 	if (!blk) {
 		printk(KERN_ERR "tmod: unable to allocate mem in write\n");
 		return -ENOMEM;
 	}
 	
-	retval = copy_from_user(blk, ubuf, len_cut);
-	if (retval) {
+	if (tmod_blk_from_user(blk, ubuf, len_cut)) {
 		printk(KERN_ERR "tmod: copy_from_user failed\n");
-		kfree(blk);
+		tmod_blk_free(blk);
 		return -EFAULT;
 	}
+	blk->len = len_cut;
 	
-	/* Try to push the message into the input buffer */
-	mutex_lock(&ctx->m_lock);
-	while (ctx->blks_in >= ctx->blk_mnum) {
-		mutex_unlock(&ctx->m_lock);
-		if (wait_event_interruptible(ctx->blks_in_not_full, (ctx->blks_in < ctx->blk_mnum))) {
-			/* if woken up by a signal return */
-			printk(KERN_INFO "tmod: proc %u interrupted up by a signal"
-					" while waiting in write()\n", (unsigned)current->pid);
-			return -ERESTARTSYS;
-		}
-		mutex_lock(&ctx->m_lock);
-	}
+	/* The workers charge what they allocate for this block to the writer */
+	blk->memcg = get_mem_cgroup_from_mm(current->mm);
 	
-	/* Push message (and check consistency) */
-	retval = tmod_buff_push(ctx->buff_in, blk, len_cut);
-	BUG_ON(!retval);
+	retval = tmod_cdev_submit(ctx, blk);
+	if (retval) {
+		tmod_blk_free(blk);
+		return retval;
+	}
 	
-	/* Increment status variable associated with the wait queue and "signal" */
-	ctx->blks_in++;
-	wake_up_interruptible(&ctx->blks_in_not_empty);
+	return (ssize_t)len_cut;	
+}
+
+/* Explicit flush of the staged bytes: on close() and fsync() */
+static int cdev_flush(struct file *file, fl_owner_t id)
+{
+	struct cdev_ctx *ctx;
+	struct miscdevice *misc_dev;
 	
-	mutex_unlock(&ctx->m_lock);
+	misc_dev = file->private_data;
+	ctx = container_of(misc_dev, struct cdev_ctx, msc_cdev);
 	
-	return (ssize_t)len_cut;	
+	return tmod_cdev_flush(ctx);
+}
+
+static int cdev_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	return cdev_flush(file, NULL);
 }
 
 static int cdev_close(struct inode *inode, struct file *file)
@@ -217,77 +860,141 @@ static int cdev_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
-static const char *dev_name_str = "enc_dev";
-
 static const struct file_operations msc_cdev_fops = {
 	.owner		= THIS_MODULE,
 	.read		= cdev_read,
 	.open 		= cdev_open,
 	.release 	= cdev_close,
-	.write		= cdev_write
+	.write		= cdev_write,
+	.flush		= cdev_flush,
+	.fsync		= cdev_fsync
 };
 
+/* Result cache counters under /sys/class/misc/<name>/ */
+#define TMOD_CACHE_ATTR(field, fmt)											\
+static ssize_t cache_##field##_show(struct device *dev,						\
+									struct device_attribute *attr, char *buf)	\
+{																			\
+	struct tmod_cache_stats stats;											\
+	struct cdev_ctx *ctx;													\
+																			\
+	ctx = container_of(dev_get_drvdata(dev), struct cdev_ctx, msc_cdev);	\
+	tmod_cache_get_stats(ctx->cache, &stats);								\
+																			\
+	return sysfs_emit(buf, fmt "\n", stats.field);							\
+}																			\
+static DEVICE_ATTR_RO(cache_##field)
+
+TMOD_CACHE_ATTR(hits, "%llu");
+TMOD_CACHE_ATTR(misses, "%llu");
+TMOD_CACHE_ATTR(evictions, "%llu");
+TMOD_CACHE_ATTR(entries, "%zu");
+TMOD_CACHE_ATTR(mem, "%zu");
+
+static struct attribute *tmod_cache_attrs[] = {
+	&dev_attr_cache_hits.attr,
+	&dev_attr_cache_misses.attr,
+	&dev_attr_cache_evictions.attr,
+	&dev_attr_cache_entries.attr,
+	&dev_attr_cache_mem.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(tmod_cache);
+
 /*--------------------------------------------------------------------*/
 
-int tmod_worker(void *data)
+/*
+ * Run blk_in through the stage. Returns the block for the next queue:
+ * on failure blk_in itself, marked as lost so that the reader finds out
+ * in its place (and a block count stays in step with the writes).
+*/
+static struct tmod_blk *tmod_worker_process(struct tmod_stage_wrk *wrk, struct tmod_blk *blk_in,
+											size_t blk_len)
 {
-	size_t retval;
-	size_t blk_len;
-	struct cdev_ctx *ctx;
-	char *blk_in;
-	char *blk_out;
+	ssize_t out_len;
+	struct tmod_blk *blk_out;
+	
+	/* Cached result (already encoded) or lost block: forward it */
+	if (blk_in->cached || blk_in->err) {
+		return blk_in;
+	}
+	
+	/* Process data */
+	blk_out = tmod_blk_alloc(tmod_stage_out_mlen(&wrk->stage, blk_len), TMOD_BLK_GFP);
+	if (!blk_out) {
+		printk(KERN_ERR "tmod: unable to allocate mem in worker thread\n");
+		blk_in->err = -EIO;
+		return blk_in;
+	}
+	
+	out_len = tmod_stage_run(&wrk->stage, blk_in, blk_out, wrk->tag_in, wrk->tag_out);
+	if (out_len <= 0) {
+		printk(KERN_ERR "tmod: %s stage failed on block\n", tmod_stage_name(&wrk->stage));
+		tmod_blk_free(blk_out);
+		blk_in->err = -EIO;
+		return blk_in;
+	}
+	
+	blk_out->memcg = blk_in->memcg;
+	blk_in->memcg = NULL;
+	
+	/* Carry the original input along to cache the final result */
+	if (wrk->ctx->cache) {
+		if (wrk->q_in == &wrk->ctx->queues[0]) {
+			blk_out->src = blk_in;
+			blk_in = NULL;
+		} else {
+			blk_out->src = blk_in->src;
+			blk_in->src = NULL;
+		}
+	}
+	tmod_blk_free(blk_in);
+	
+	if (blk_out->src && wrk->q_out == &wrk->ctx->queues[wrk->ctx->stages_num]) {
+		if (blk_out->len <= wrk->ctx->cache_len_max) {
+			tmod_cache_insert(wrk->ctx->cache, blk_out->src, blk_out);
+		}
+		tmod_blk_free(blk_out->src);
+		blk_out->src = NULL;
+	}
+	
+	printk(KERN_DEBUG "tmod: worker: block processed by %s\n", tmod_stage_name(&wrk->stage));
+	
+	return blk_out;
+}
+
+static int tmod_worker(void *data)
+{
+	int retval;
+	ssize_t blk_len;
+	struct tmod_stage_wrk *wrk;
+	struct tmod_blk *blk_in;
+	struct tmod_blk *blk_out;
+	struct mem_cgroup *old_memcg;
 	
-	ctx = (struct cdev_ctx *)data;
+	wrk = (struct tmod_stage_wrk *)data;
 	
 	while (!kthread_should_stop()) {
 		
 		/* Wait for input data */
-		mutex_lock(&ctx->m_lock);
-		while (ctx->blks_in == 0) {
-			mutex_unlock(&ctx->m_lock);
-			wait_event_interruptible(ctx->blks_in_not_empty, 
-									((ctx->blks_in > 0) || kthread_should_stop()));
-			if (kthread_should_stop()) {break;}
-			mutex_lock(&ctx->m_lock);
+		blk_len = tmod_queue_pop(wrk->q_in, &blk_in, NULL);
+		if (blk_len <= 0) {
+			continue;
 		}
 		
-		/* Get data from the input buffer */
-		blk_len = tmod_buff_pop(ctx->buff_in, &blk_in);
-		BUG_ON(!blk_len);
-		
-		ctx->blks_in--;
-		wake_up_interruptible(&ctx->blks_in_not_full);
+		/* Charge the allocations for this block to its writer */
+		old_memcg = set_active_memcg(blk_in->memcg);
 		
-		mutex_unlock(&ctx->m_lock);
+		blk_out = tmod_worker_process(wrk, blk_in, blk_len);
 		
-		/* Process data */
-		blk_out = kzalloc(blk_len, GFP_USER);
-		if (!blk_out) {
-			printk(KERN_ERR "tmod: unable to allocate mem in worker thread\n");
-			return -ENOMEM;
+		/* Put processed data into the next queue */
+		retval = tmod_queue_push(wrk->q_out, blk_out, false);
+		if (retval) {
+			tmod_blk_free(blk_out);
+			tmod_cdev_drop(wrk->ctx);
 		}
 		
-		tmod_worker_body(blk_in, blk_out, blk_len, ctx->key);
-		printk(KERN_DEBUG "tmod: worker: block encoded\n");
-		
-		kfree(blk_in);
-		
-		/* Put processed data into queue */
-		mutex_lock(&ctx->m_lock);
-		while (ctx->blks_out >= ctx->blk_mnum) {
-			mutex_unlock(&ctx->m_lock);
-			wait_event_interruptible(ctx->blks_out_not_full,
-									(ctx->blks_out < ctx->blk_mnum) || kthread_should_stop());
-			mutex_lock(&ctx->m_lock);
-		}
-		
-		retval = tmod_buff_push(ctx->buff_out, blk_out, blk_len);
-		BUG_ON(!retval);
-		
-		ctx->blks_out++;
-		wake_up_interruptible(&ctx->blks_out_not_empty);
-		
-		mutex_unlock(&ctx->m_lock);
+		set_active_memcg(old_memcg);
 	}
 	
 	return 0;
@@ -295,79 +1002,207 @@ int tmod_worker(void *data)
 
 /*--------------------------------------------------------------------*/
 
+/* Stop the workers and release stages and queues, also on partial init */
+static void tmod_cdev_free(struct cdev_ctx *ctx)
+{
+	size_t i;
+	
+	/*
+	 * No more timeouts, then drop the staged bytes. The work never waits
+	 * on a queue but may re-arm the timer, that then queues nothing.
+	 */
+	if (ctx->co_ns) {
+		WRITE_ONCE(ctx->co_stop, true);
+		hrtimer_cancel(&ctx->co_timer);
+		cancel_work_sync(&ctx->co_work);
+		hrtimer_cancel(&ctx->co_timer);
+		tmod_blk_free(ctx->co_blk);
+		mutex_destroy(&ctx->co_lock);
+	}
+	
+	for (i = 0; i < TMOD_STAGES_MAX; i++) {
+		/* Blocks until the thread has stopped */
+		if (ctx->stages[i].worker_p) {
+			kthread_stop(ctx->stages[i].worker_p);
+		}
+		tmod_stage_destroy(&ctx->stages[i].stage);
+	}
+	
+	for (i = 0; i <= TMOD_STAGES_MAX; i++) {
+		tmod_queue_destroy(&ctx->queues[i]);
+	}
+	
+	tmod_cache_destroy(ctx->cache);
+	
+	kfree(ctx);
+}
+
+/* Parse the comma separated stage list */
+static int tmod_cdev_parse_stages(struct cdev_ctx *ctx, const char *stages)
+{
+	int retval = 0;
+	char *names;
+	char *cursor;
+	char *name;
+	
+	names = kstrdup(stages, GFP_KERNEL);
+	if (!names) {
+		return -ENOMEM;
+	}
+	
+	cursor = names;
+	while ((name = strsep(&cursor, ",")) != NULL) {
+		if (!*name) {
+			continue;
+		}
+		
+		if (ctx->stages_num == TMOD_STAGES_MAX) {
+			printk(KERN_ERR "tmod: too many stages, max %d\n", TMOD_STAGES_MAX);
+			retval = -EINVAL;
+			break;
+		}
+		
+		retval = tmod_stage_init(&ctx->stages[ctx->stages_num].stage, name, ctx->key);
+		if (retval) {
+			break;
+		}
+		ctx->stages_num++;
+	}
+	
+	kfree(names);
+	
+	if (!retval && !ctx->stages_num) {
+		printk(KERN_ERR "tmod: empty stage list\n");
+		retval = -EINVAL;
+	}
+	
+	return retval;
+}
+
 /* 
  * note: called by init in tmod.c
  * 
  * note: no need to use dev_set_drvdata() to store the context in the
  * device handler since it is passed back by the user
  */
-int tmod_cdev_create(struct cdev_ctx **ctx, size_t blk_mnum, size_t blk_mlen, char key)
+int tmod_cdev_create(struct cdev_ctx **ctx, const struct tmod_cdev_cfg *cfg)
 {
 	int retval;
+	size_t i;
+	size_t q_mlen;
+	size_t q_mem;
+	struct tmod_stage_wrk *wrk;
 	
 	*ctx = kzalloc(sizeof(**ctx), GFP_USER);
-	if (!ctx) {
+	if (!(*ctx)) {
 		printk(KERN_ERR "tmod: unable to allocate mem in cdev create\n");
 		return -ENOMEM;
 	}
 	
-	mutex_init(&(*ctx)->m_lock);
-	
 	atomic_set(&(*ctx)->users_cnt_a, 2 + 1);
-	(*ctx)->blk_mnum = blk_mnum;
-	(*ctx)->blk_mlen = blk_mlen;
-	(*ctx)->key = key;
+	atomic_set(&(*ctx)->blks_inflight, 0);
+	(*ctx)->blk_mnum = cfg->blk_mnum;
+	(*ctx)->blk_mlen = cfg->blk_mlen;
+	(*ctx)->key = cfg->key;
+	(*ctx)->tag = cfg->tag;
 	
-	(*ctx)->blks_in = 0;
-	(*ctx)->blks_out = 0;
+	/* Coalescing of small writes */
+	(*ctx)->co_ns = (u64)cfg->coalesce_us * NSEC_PER_USEC;
+	if ((*ctx)->co_ns) {
+		mutex_init(&(*ctx)->co_lock);
+		/* hrtimer_setup() since 6.13, hrtimer_init() is gone since 6.15 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+		hrtimer_setup(&(*ctx)->co_timer, tmod_cdev_co_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+		hrtimer_init(&(*ctx)->co_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		(*ctx)->co_timer.function = tmod_cdev_co_timer;
+#endif
+		INIT_WORK(&(*ctx)->co_work, tmod_cdev_co_work);
+	}
 	
-	init_waitqueue_head(&(*ctx)->blks_in_not_full);
-	init_waitqueue_head(&(*ctx)->blks_in_not_empty);
-	init_waitqueue_head(&(*ctx)->blks_out_not_full);
-	init_waitqueue_head(&(*ctx)->blks_out_not_empty);
+	retval = tmod_cdev_parse_stages(*ctx, cfg->stages);
+	if (retval) {
+		tmod_cdev_free(*ctx);
+		return retval;
+	}
 	
-	/* Init input buffer */
-	retval = tmod_buff_init(&(*ctx)->buff_in, blk_mnum, blk_mlen);
-	if (retval < 0) {
-		printk(KERN_ERR "tmod: unable to initialize the buffer dev\n");
-		kfree(*ctx);
-		return -ENOMEM;
+	/*
+	 * Init queues, each sized for the worst case output of the previous
+	 * stage. The default budget holds blk_mnum blocks of that size.
+	 */
+	q_mlen = cfg->blk_mlen;
+	for (i = 0; i <= (*ctx)->stages_num; i++) {
+		if (i > 0) {
+			q_mlen = tmod_stage_out_mlen(&(*ctx)->stages[i - 1].stage, q_mlen);
+		}
+		
+		q_mem = cfg->queue_mem ? cfg->queue_mem : cfg->blk_mnum * tmod_buff_blk_mem(q_mlen);
+		retval = tmod_queue_init(&(*ctx)->queues[i], cfg->blk_slots, q_mlen, q_mem,
+									(u64)cfg->poll_us * NSEC_PER_USEC);
+		if (retval < 0) {
+			tmod_cdev_free(*ctx);
+			return retval;
+		}
 	}
 	
-	/* Init output buffer */
-	retval = tmod_buff_init(&(*ctx)->buff_out, blk_mnum, blk_mlen);
-	if (retval < 0) {
-		printk(KERN_ERR "tmod: unable to initialize the buffer dev\n");
-		tmod_buff_destroy((*ctx)->buff_in);
-		kfree(*ctx);
-		return -ENOMEM;
+	/* Result cache: a hit travels through every queue */
+	if (cfg->cache_mem) {
+		retval = tmod_cache_init(&(*ctx)->cache, cfg->cache_mem, cfg->key);
+		if (retval < 0) {
+			tmod_cdev_free(*ctx);
+			return retval;
+		}
+		
+		(*ctx)->cache_len_max = (*ctx)->queues[0].blk_mlen;
+		for (i = 1; i <= (*ctx)->stages_num; i++) {
+			(*ctx)->cache_len_max = min((*ctx)->cache_len_max, (*ctx)->queues[i].blk_mlen);
+		}
 	}
 	
-	/* Start worker thread */
-	(*ctx)->worker_p = kthread_run(tmod_worker, *ctx, "tmod_worker_thread");
-	/* test error from pointer */
-	if (IS_ERR((*ctx)->worker_p)) {
-		printk(KERN_INFO "tmod: proc %i interrupted up by a signal\n", (unsigned)current->pid);
-		/* decode error number from the pointer */
-		return PTR_ERR(((*ctx)->worker_p));
+	/* Start one worker thread per stage */
+	for (i = 0; i < (*ctx)->stages_num; i++) {
+		wrk = &(*ctx)->stages[i];
+		wrk->ctx = *ctx;
+		wrk->q_in = &(*ctx)->queues[i];
+		wrk->q_out = &(*ctx)->queues[i + 1];
+		wrk->tag_in = cfg->tag && i == 0;
+		wrk->tag_out = cfg->tag && (i == (*ctx)->stages_num - 1);
+		
+		wrk->worker_p = kthread_run(tmod_worker, wrk, "tmod_%s_%zu",
+									tmod_stage_name(&wrk->stage), i);
+		/* test error from pointer */
+		if (IS_ERR(wrk->worker_p)) {
+			printk(KERN_ERR "tmod: unable to start the %s worker\n",
+					tmod_stage_name(&wrk->stage));
+			/* decode error number from the pointer */
+			retval = PTR_ERR(wrk->worker_p);
+			wrk->worker_p = NULL;
+			tmod_cdev_free(*ctx);
+			return retval;
+		}
 	}
 	
 	/* Misc char device */
 	(*ctx)->msc_cdev.minor = MISC_DYNAMIC_MINOR;
-	(*ctx)->msc_cdev.name = dev_name_str;
+	(*ctx)->msc_cdev.name = cfg->name;
 	(*ctx)->msc_cdev.fops = &msc_cdev_fops;
+	if ((*ctx)->cache) {
+		(*ctx)->msc_cdev.groups = tmod_cache_groups;
+	}
 	
 	retval = misc_register(&(*ctx)->msc_cdev);
 	if (retval < 0) {
 		printk(KERN_ERR "tmod: failed to register misc dev\n");
-		tmod_buff_destroy((*ctx)->buff_in);
-		tmod_buff_destroy((*ctx)->buff_out);
-		kfree(*ctx);
+		tmod_cdev_free(*ctx);
 		return retval;
 	}
 	
-	printk(KERN_INFO "tmod: %s successfully created with %lu buffers of size %lu bytes\n",
-			dev_name_str, (*ctx)->blk_mnum, (*ctx)->blk_mlen);
+	printk(KERN_INFO "tmod: %s successfully created with %lu buffers of size %lu bytes"
+			" (queue budget %zu bytes, %zu slots), stages %s%s, busy poll %lu us,"
+			" cache %zu bytes, coalesce %lu us\n", cfg->name, (*ctx)->blk_mnum, (*ctx)->blk_mlen,
+			cfg->queue_mem ? cfg->queue_mem : cfg->blk_mnum * tmod_buff_blk_mem(cfg->blk_mlen),
+			cfg->blk_slots, cfg->stages, cfg->tag ? ", tagged" : "", cfg->poll_us,
+			cfg->cache_mem, cfg->coalesce_us);
 	
 	return 0;
 }
@@ -375,15 +1210,14 @@ int tmod_cdev_create(struct cdev_ctx **ctx, size_t blk_mnum, size_t blk_mlen, ch
 /* note: called by exit in tmod.c */
 void tmod_cdev_destroy(struct cdev_ctx *ctx)
 {
-	/* Blocks until the thread has stopped */
-	kthread_stop(ctx->worker_p);
-	
-	mutex_destroy(&ctx->m_lock);
-	
-	tmod_buff_destroy(ctx->buff_in);
-	tmod_buff_destroy(ctx->buff_out);
+	struct tmod_cache_stats stats;
 	
 	misc_deregister(&ctx->msc_cdev);
 	
-	kfree(ctx);
+	if (!tmod_cdev_cache_stats(ctx, &stats)) {
+		printk(KERN_INFO "tmod: cache %llu hits, %llu misses, %llu evictions\n",
+				stats.hits, stats.misses, stats.evictions);
+	}
+	
+	tmod_cdev_free(ctx);
 }
@@ -13,9 +13,50 @@
 
 #include <linux/types.h>
 
+/* Max number of stages in the pipeline */
+#define TMOD_STAGES_MAX		4
+
 struct cdev_ctx;
+struct tmod_blk;
+
+struct tmod_cdev_cfg {
+	const char *name;		/* misc device name */
+	size_t blk_mnum;		/* default queue budget, in blocks of blk_mlen */
+	size_t blk_mlen;		/* max block length on write() */
+	size_t queue_mem;		/* queue budget in bytes, 0 = blk_mnum blocks */
+	size_t blk_slots;		/* max blocks per queue, 0 = no limit */
+	char key;
+	bool tag;				/* CRC32C record header on read() */
+	const char *stages;		/* comma separated stage names, e.g. "lz4,xor" */
+	unsigned long poll_us;	/* max busy poll before sleeping, 0 = off */
+	size_t cache_mem;		/* result cache size in bytes, 0 = off */
+	unsigned long coalesce_us;	/* staging timeout for small writes, 0 = off */
+};
 
-int tmod_cdev_create(struct cdev_ctx **ctx, size_t blk_mnum, size_t blk_mlen, char key);
+int tmod_cdev_create(struct cdev_ctx **ctx, const struct tmod_cdev_cfg *cfg);
 void tmod_cdev_destroy(struct cdev_ctx *ctx);
 
+/* Kernel side of write() and read(), also used by the KUnit tests */
+int tmod_cdev_submit(struct cdev_ctx *ctx, struct tmod_blk *blk);
+ssize_t tmod_cdev_collect(struct cdev_ctx *ctx, struct tmod_blk **blk);
+
+/*
+ * Coalescing mode: append len bytes (at most blk_mlen) of buf to the
+ * staging block, dispatched once full, on timeout or on flush.
+ * Returns len or a negative error.
+ */
+ssize_t tmod_cdev_coalesce(struct cdev_ctx *ctx, const char *buf, size_t len);
+int tmod_cdev_flush(struct cdev_ctx *ctx);
+
+/*
+ * Busy poll self-tuning: new inter-arrival average after a gap, and the
+ * spin budget for an average (zero: sleep right away). In nanoseconds.
+ */
+u64 tmod_cdev_poll_avg(u64 avg, u64 gap, u64 poll_ns_max);
+u64 tmod_cdev_poll_budget(u64 avg, u64 poll_ns_max);
+
+/* Result cache counters, -ENODEV if the cache is off */
+struct tmod_cache_stats;
+int tmod_cdev_cache_stats(struct cdev_ctx *ctx, struct tmod_cache_stats *stats);
+
 #endif /* TMOD_CDEV_H */
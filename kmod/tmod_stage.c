@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/lz4.h>
+#include <linux/crc32c.h>
+
+#include "tmod_blk.h"
+#include "tmod_stage.h"
+#include "tmod_worker.h"
+
+struct tmod_stage_ops {
+	const char *name;
+	int (*init)(struct tmod_stage *stage);
+	void (*destroy)(struct tmod_stage *stage);
+	size_t (*out_mlen)(size_t in_len);
+	ssize_t (*run)(struct tmod_stage *stage, struct tmod_blk *blk_in,
+					struct tmod_blk *blk_out, u32 *crc_in, u32 *crc_out);
+};
+
+/*------------------------------- XOR --------------------------------*/
+
+static size_t xor_out_mlen(size_t in_len)
+{
+	return in_len;
+}
+
+/* Walk both segment vectors, encoding (and checksumming) a chunk at a time */
+static ssize_t xor_run(struct tmod_stage *stage, struct tmod_blk *blk_in,
+						struct tmod_blk *blk_out, u32 *crc_in, u32 *crc_out)
+{
+	struct tmod_blk_iter iter_in;
+	struct tmod_blk_iter iter_out;
+	size_t cut_in;
+	size_t left;
+	size_t cut;
+	char *seg_in;
+	char *seg_out;
+	
+	if (blk_out->mlen < blk_in->len) {
+		return -EINVAL;
+	}
+	
+	tmod_blk_iter_init(&iter_in, blk_in, 0);
+	tmod_blk_iter_init(&iter_out, blk_out, 0);
+	
+	for (left = blk_in->len; left; left -= cut) {
+		seg_in = tmod_blk_iter_get(&iter_in, left, &cut_in);
+		seg_out = tmod_blk_iter_get(&iter_out, cut_in, &cut);
+		
+		tmod_worker_body(seg_in, seg_out, cut, stage->key, crc_in, crc_out);
+		
+		tmod_blk_iter_advance(&iter_in, cut);
+		tmod_blk_iter_advance(&iter_out, cut);
+	}
+	
+	return (ssize_t)blk_in->len;
+}
+
+/*------------------------------- LZ4 --------------------------------*/
+
+static int lz4_init(struct tmod_stage *stage)
+{
+	stage->wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+	if (!stage->wrkmem) {
+		return -ENOMEM;
+	}
+	
+	return 0;
+}
+
+static void lz4_destroy(struct tmod_stage *stage)
+{
+	vfree(stage->wrkmem);
+}
+
+static size_t lz4_out_mlen(size_t in_len)
+{
+	return LZ4_compressBound(in_len);
+}
+
+/* The library needs contiguous buffers and its pass cannot be fused */
+static ssize_t lz4_run(struct tmod_stage *stage, struct tmod_blk *blk_in,
+						struct tmod_blk *blk_out, u32 *crc_in, u32 *crc_out)
+{
+	int retval;
+	char *src;
+	char *dst;
+	
+	src = tmod_blk_map(blk_in);
+	dst = tmod_blk_map(blk_out);
+	if (!src || !dst) {
+		tmod_blk_unmap(blk_in, src);
+		tmod_blk_unmap(blk_out, dst);
+		return -ENOMEM;
+	}
+	
+	retval = LZ4_compress_default(src, dst, blk_in->len, blk_out->mlen, stage->wrkmem);
+	
+	if (retval > 0 && crc_in) {
+		*crc_in = crc32c(*crc_in, src, blk_in->len);
+	}
+	if (retval > 0 && crc_out) {
+		*crc_out = crc32c(*crc_out, dst, retval);
+	}
+	
+	tmod_blk_unmap(blk_in, src);
+	tmod_blk_unmap(blk_out, dst);
+	
+	return retval > 0 ? retval : -EIO;
+}
+
+/*--------------------------------------------------------------------*/
+
+static const struct tmod_stage_ops stage_ops[] = {
+	{
+		.name		= "xor",
+		.out_mlen	= xor_out_mlen,
+		.run		= xor_run,
+	},
+	{
+		.name		= "lz4",
+		.init		= lz4_init,
+		.destroy	= lz4_destroy,
+		.out_mlen	= lz4_out_mlen,
+		.run		= lz4_run,
+	},
+};
+
+int tmod_stage_init(struct tmod_stage *stage, const char *name, char key)
+{
+	size_t i;
+	
+	memset(stage, 0, sizeof(*stage));
+	
+	for (i = 0; i < ARRAY_SIZE(stage_ops); i++) {
+		if (!strcmp(stage_ops[i].name, name)) {
+			stage->ops = &stage_ops[i];
+			break;
+		}
+	}
+	
+	if (!stage->ops) {
+		printk(KERN_ERR "tmod: unknown stage %s\n", name);
+		return -EINVAL;
+	}
+	
+	stage->key = key;
+	
+	return stage->ops->init ? stage->ops->init(stage) : 0;
+}
+
+void tmod_stage_destroy(struct tmod_stage *stage)
+{
+	if (stage->ops && stage->ops->destroy) {
+		stage->ops->destroy(stage);
+	}
+	
+	stage->ops = NULL;
+}
+
+const char *tmod_stage_name(const struct tmod_stage *stage)
+{
+	return stage->ops->name;
+}
+
+size_t tmod_stage_out_mlen(const struct tmod_stage *stage, size_t in_len)
+{
+	return stage->ops->out_mlen(in_len);
+}
+
+ssize_t tmod_stage_run(struct tmod_stage *stage, struct tmod_blk *blk_in,
+						struct tmod_blk *blk_out, bool tag_in, bool tag_out)
+{
+	ssize_t retval;
+	u32 crc_in = ~0U;
+	u32 crc_out = ~0U;
+	
+	retval = stage->ops->run(stage, blk_in, blk_out, tag_in ? &crc_in : NULL,
+								tag_out ? &crc_out : NULL);
+	if (retval < 0) {
+		return retval;
+	}
+	
+	blk_out->len = retval;
+	blk_out->crc_in = tag_in ? ~crc_in : blk_in->crc_in;
+	if (tag_out) {
+		blk_out->crc_out = ~crc_out;
+	}
+	
+	return retval;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#ifndef TMOD_STAGE_H
+#define TMOD_STAGE_H
+
+#include <linux/types.h>
+
+struct tmod_stage_ops;
+struct tmod_blk;
+
+/* One transform of the pipeline (see tmod_stage.c for the list) */
+struct tmod_stage {
+	const struct tmod_stage_ops *ops;
+	char key;
+	void *wrkmem;
+};
+
+int tmod_stage_init(struct tmod_stage *stage, const char *name, char key);
+void tmod_stage_destroy(struct tmod_stage *stage);
+
+const char *tmod_stage_name(const struct tmod_stage *stage);
+
+/* Worst case output length for an input block of in_len bytes */
+size_t tmod_stage_out_mlen(const struct tmod_stage *stage, size_t in_len);
+
+/*
+ * Transform blk_in into blk_out (allocated with tmod_stage_out_mlen()),
+ * setting blk_out->len. blk_out->crc_in is the CRC32C of the input with
+ * tag_in set (first stage), otherwise the one of blk_in is carried over.
+ * With tag_out set (last stage) blk_out->crc_out is the CRC32C of the
+ * output. Returns the output length or a negative error.
+ */
+ssize_t tmod_stage_run(struct tmod_stage *stage, struct tmod_blk *blk_in,
+						struct tmod_blk *blk_out, bool tag_in, bool tag_out);
+
+#endif /* TMOD_STAGE_H */
@@ -0,0 +1,1201 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#include <kunit/test.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/crc32c.h>
+#include <linux/lz4.h>
+
+#include "tmod_blk.h"
+#include "tmod_buff.h"
+#include "tmod_cache.h"
+#include "tmod_cdev.h"
+#include "tmod_stage.h"
+#include "tmod_worker.h"
+
+#define TMOD_TEST_KEY			'k'
+#define TMOD_TEST_BUFFS			4
+#define TMOD_TEST_BUFF_LEN		64
+
+/* Pipeline stress parameters: small queues to hit backpressure often */
+#define TMOD_TEST_STRESS_MNUM	2
+#define TMOD_TEST_STRESS_MLEN	16
+#define TMOD_TEST_STRESS_BLKS	256
+
+/* Distinct blocks in the cached stress run, the rest are repeats */
+#define TMOD_TEST_CACHE_UNIQ	8
+#define TMOD_TEST_CACHE_MEM		(64 << 10)
+
+/* Coalescing: never expires during a test, and expires quickly */
+#define TMOD_TEST_CO_US			(10 * USEC_PER_SEC)
+#define TMOD_TEST_CO_SHORT_US	1000
+
+/* Above the per block worker time, so that polling actually kicks in */
+#define TMOD_TEST_POLL_US		5000
+
+#define TMOD_TEST_BENCH_ITERS	100000
+
+/*---------------------------- Helpers -------------------------------*/
+
+static char tmod_test_pattern(size_t blk_idx, size_t byte_idx)
+{
+	return (char)((blk_idx * 31 + byte_idx) & 0xff);
+}
+
+static void tmod_test_fill(char *blk, size_t len, size_t blk_idx)
+{
+	size_t cursor;
+
+	for (cursor = 0; cursor < len; cursor++) {
+		blk[cursor] = tmod_test_pattern(blk_idx, cursor);
+	}
+}
+
+/* Block of len bytes filled with the pattern of blk_idx */
+static struct tmod_blk *tmod_test_blk(size_t len, size_t blk_idx)
+{
+	struct tmod_blk *blk;
+	char *buf;
+
+	blk = tmod_blk_alloc(len, GFP_KERNEL);
+	buf = kmalloc(len, GFP_KERNEL);
+	if (!blk || !buf) {
+		tmod_blk_free(blk);
+		kfree(buf);
+		return NULL;
+	}
+
+	tmod_test_fill(buf, len, blk_idx);
+	tmod_blk_from_buf(blk, buf, len);
+	blk->len = len;
+
+	kfree(buf);
+
+	return blk;
+}
+
+/*---------------------------- tmod_blk ------------------------------*/
+
+static void tmod_blk_test_layout(struct kunit *test)
+{
+	struct tmod_blk *blk;
+
+	/* Small blocks are inline */
+	blk = tmod_blk_alloc(TMOD_TEST_BUFF_LEN, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+	KUNIT_EXPECT_EQ(test, blk->pages_num, 0U);
+	KUNIT_EXPECT_EQ(test, tmod_blk_segs(blk), 1U);
+	/* Charged for their whole slab object */
+	KUNIT_EXPECT_EQ(test, tmod_blk_size(TMOD_TEST_BUFF_LEN), ksize(blk));
+	tmod_blk_free(blk);
+
+	/* Large blocks are a page vector, last page partially used */
+	blk = tmod_blk_alloc(3 * PAGE_SIZE + 1, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+	KUNIT_EXPECT_EQ(test, blk->pages_num, 4U);
+	KUNIT_EXPECT_EQ(test, tmod_blk_segs(blk), 4U);
+	tmod_blk_free(blk);
+}
+
+/* Copy in and out across page boundaries, then through a vmap() view */
+static void tmod_blk_test_copy(struct kunit *test)
+{
+	const size_t len = 2 * PAGE_SIZE + 100;
+	struct tmod_blk *blk;
+	char *src;
+	char *dst;
+	char *map;
+
+	src = kunit_kzalloc(test, len, GFP_KERNEL);
+	dst = kunit_kzalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, src);
+	KUNIT_ASSERT_NOT_NULL(test, dst);
+
+	blk = tmod_blk_alloc(len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+
+	tmod_test_fill(src, len, 7);
+	KUNIT_EXPECT_EQ(test, tmod_blk_from_buf(blk, src, len), (size_t)0);
+	KUNIT_EXPECT_EQ(test, tmod_blk_to_buf(dst, blk, len), (size_t)0);
+	KUNIT_EXPECT_EQ(test, memcmp(src, dst, len), 0);
+
+	map = tmod_blk_map(blk);
+	KUNIT_EXPECT_NOT_NULL(test, map);
+	if (map) {
+		KUNIT_EXPECT_EQ(test, memcmp(src, map, len), 0);
+		tmod_blk_unmap(blk, map);
+	}
+
+	tmod_blk_free(blk);
+}
+
+/* Appends resume mid-page and straddle page boundaries, none past mlen */
+static void tmod_blk_test_append(struct kunit *test)
+{
+	const size_t len = 2 * PAGE_SIZE + 100;
+	struct tmod_blk *blk;
+	size_t off = 0;
+	size_t cut;
+	char *src;
+	char *dst;
+
+	src = kunit_kzalloc(test, len, GFP_KERNEL);
+	dst = kunit_kzalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, src);
+	KUNIT_ASSERT_NOT_NULL(test, dst);
+
+	blk = tmod_blk_alloc(len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+
+	tmod_test_fill(src, len, 5);
+	while (off < len) {
+		cut = min_t(size_t, len - off, PAGE_SIZE / 3 + 1);
+		KUNIT_EXPECT_EQ(test, tmod_blk_append_buf(blk, src + off, cut), (size_t)0);
+		off += cut;
+	}
+	KUNIT_EXPECT_EQ(test, blk->len, len);
+
+	/* Full: nothing copied, the length stays */
+	KUNIT_EXPECT_EQ(test, tmod_blk_append_buf(blk, src, 1), (size_t)1);
+	KUNIT_EXPECT_EQ(test, blk->len, len);
+
+	KUNIT_EXPECT_EQ(test, tmod_blk_to_buf(dst, blk, len), (size_t)0);
+	KUNIT_EXPECT_EQ(test, memcmp(src, dst, len), 0);
+
+	tmod_blk_free(blk);
+}
+
+/* Copies compare equal whatever their layout, a single byte breaks it */
+static void tmod_blk_test_dup(struct kunit *test)
+{
+	const size_t len = 2 * PAGE_SIZE + 100;
+	struct tmod_blk *blk;
+	struct tmod_blk *dup;
+	size_t seg_len;
+	char *seg;
+
+	blk = tmod_test_blk(len, 3);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+	blk->crc_in = 1;
+	blk->crc_out = 2;
+
+	dup = tmod_blk_dup(blk, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dup);
+	KUNIT_EXPECT_EQ(test, dup->len, len);
+	KUNIT_EXPECT_EQ(test, dup->crc_in, (u32)1);
+	KUNIT_EXPECT_EQ(test, dup->crc_out, (u32)2);
+	KUNIT_EXPECT_TRUE(test, tmod_blk_equal(blk, dup));
+
+	seg = tmod_blk_seg(dup, 1, &seg_len);
+	seg[1] ^= 1;
+	KUNIT_EXPECT_FALSE(test, tmod_blk_equal(blk, dup));
+	tmod_blk_free(dup);
+
+	/* Short data in a page vector: the copy is inline */
+	blk->len = 100;
+	dup = tmod_blk_dup(blk, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dup);
+	KUNIT_EXPECT_EQ(test, tmod_blk_segs(dup), 1U);
+	KUNIT_EXPECT_TRUE(test, tmod_blk_equal(blk, dup));
+
+	tmod_blk_free(dup);
+	tmod_blk_free(blk);
+}
+
+static void tmod_blk_bench_alloc(struct kunit *test)
+{
+	static const size_t blk_lens[] = { 64, 64 << 10, 1 << 20, 8 << 20 };
+	struct tmod_blk *blk;
+	u64 start;
+	u64 elapsed;
+	size_t i;
+	int iter;
+
+	for (i = 0; i < ARRAY_SIZE(blk_lens); i++) {
+		start = ktime_get_ns();
+		for (iter = 0; iter < 16; iter++) {
+			blk = tmod_blk_alloc(blk_lens[i], GFP_KERNEL);
+			KUNIT_ASSERT_NOT_NULL(test, blk);
+			tmod_blk_free(blk);
+		}
+		elapsed = ktime_get_ns() - start;
+
+		kunit_info(test, "bench: tmod_blk alloc+free: blk_len %zu, %llu ns/op\n",
+					blk_lens[i], div_u64(elapsed, 16));
+	}
+}
+
+static struct kunit_case tmod_blk_test_cases[] = {
+	KUNIT_CASE(tmod_blk_test_layout),
+	KUNIT_CASE(tmod_blk_test_copy),
+	KUNIT_CASE(tmod_blk_test_append),
+	KUNIT_CASE(tmod_blk_test_dup),
+	KUNIT_CASE_SLOW(tmod_blk_bench_alloc),
+	{}
+};
+
+static struct kunit_suite tmod_blk_test_suite = {
+	.name = "tmod_blk",
+	.test_cases = tmod_blk_test_cases,
+};
+
+/*--------------------------- tmod_buff ------------------------------*/
+
+static void tmod_buff_test_capacity(struct kunit *test)
+{
+	struct tmod_buff *buff;
+	struct tmod_blk *blk;
+	struct tmod_blk *data;
+	size_t i;
+
+	KUNIT_ASSERT_EQ(test, tmod_buff_init(&buff, TMOD_TEST_BUFFS, TMOD_TEST_BUFF_LEN, 0), 0);
+
+	/* Fill up to capacity */
+	for (i = 0; i < TMOD_TEST_BUFFS; i++) {
+		blk = tmod_test_blk(i + 1, i);
+		KUNIT_ASSERT_NOT_NULL(test, blk);
+		KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), i + 1);
+	}
+
+	/* One more must be refused */
+	blk = tmod_test_blk(1, 0);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+	KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)0);
+
+	/* Pop in FIFO order */
+	for (i = 0; i < TMOD_TEST_BUFFS; i++) {
+		KUNIT_EXPECT_EQ(test, tmod_buff_pop(buff, &data), i + 1);
+		tmod_blk_free(data);
+	}
+
+	/* Empty again */
+	KUNIT_EXPECT_EQ(test, tmod_buff_pop(buff, &data), (size_t)0);
+
+	/* A freed slot accepts the refused block */
+	KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)1);
+
+	/* Destroy frees the blocks still queued */
+	tmod_buff_destroy(buff);
+}
+
+static void tmod_buff_test_oversize(struct kunit *test)
+{
+	struct tmod_buff *buff;
+	struct tmod_blk *blk;
+	struct tmod_blk *data;
+
+	KUNIT_ASSERT_EQ(test, tmod_buff_init(&buff, TMOD_TEST_BUFFS, TMOD_TEST_BUFF_LEN, 0), 0);
+
+	blk = tmod_test_blk(TMOD_TEST_BUFF_LEN + 1, 0);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+
+	KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)0);
+
+	blk->len = TMOD_TEST_BUFF_LEN;
+	KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)TMOD_TEST_BUFF_LEN);
+	KUNIT_EXPECT_EQ(test, tmod_buff_pop(buff, &data), (size_t)TMOD_TEST_BUFF_LEN);
+	KUNIT_EXPECT_PTR_EQ(test, data, blk);
+
+	tmod_blk_free(blk);
+	tmod_buff_destroy(buff);
+}
+
+/* Budget of two full blocks: many more small blocks fit in the same bytes */
+static void tmod_buff_test_budget(struct kunit *test)
+{
+	struct tmod_buff *buff;
+	struct tmod_blk *blk;
+	struct tmod_blk *data;
+	size_t mem_max;
+	size_t blks;
+	size_t i;
+
+	mem_max = 2 * tmod_buff_blk_mem(TMOD_TEST_BUFF_LEN);
+	KUNIT_ASSERT_EQ(test, tmod_buff_init(&buff, 0, TMOD_TEST_BUFF_LEN, mem_max), 0);
+
+	for (i = 0; i < 2; i++) {
+		blk = tmod_test_blk(TMOD_TEST_BUFF_LEN, i);
+		KUNIT_ASSERT_NOT_NULL(test, blk);
+		KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)TMOD_TEST_BUFF_LEN);
+	}
+
+	blk = tmod_test_blk(TMOD_TEST_BUFF_LEN, 2);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+	KUNIT_EXPECT_FALSE(test, tmod_buff_room(buff, blk));
+	KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)0);
+	tmod_blk_free(blk);
+
+	for (i = 0; i < 2; i++) {
+		KUNIT_EXPECT_EQ(test, tmod_buff_pop(buff, &data), (size_t)TMOD_TEST_BUFF_LEN);
+		tmod_blk_free(data);
+	}
+
+	/* One byte blocks until the budget is used up */
+	for (blks = 0; ; blks++) {
+		blk = tmod_test_blk(1, blks);
+		KUNIT_ASSERT_NOT_NULL(test, blk);
+		if (!tmod_buff_push(buff, blk)) {
+			tmod_blk_free(blk);
+			break;
+		}
+	}
+	KUNIT_EXPECT_GT(test, blks, (size_t)2);
+	KUNIT_EXPECT_LE(test, blks * tmod_buff_blk_mem(1), mem_max);
+
+	tmod_buff_destroy(buff);
+
+	/* The slot cap applies on top of the budget */
+	KUNIT_ASSERT_EQ(test, tmod_buff_init(&buff, 2, TMOD_TEST_BUFF_LEN, mem_max), 0);
+	for (i = 0; i < 3; i++) {
+		blk = tmod_test_blk(1, i);
+		KUNIT_ASSERT_NOT_NULL(test, blk);
+		if (i < 2) {
+			KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)1);
+		} else {
+			KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)0);
+			tmod_blk_free(blk);
+		}
+	}
+	tmod_buff_destroy(buff);
+
+	/* An empty buffer takes a block larger than the budget */
+	KUNIT_ASSERT_EQ(test, tmod_buff_init(&buff, 0, TMOD_TEST_BUFF_LEN, 1), 0);
+	blk = tmod_test_blk(TMOD_TEST_BUFF_LEN, 0);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+	KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)TMOD_TEST_BUFF_LEN);
+	blk = tmod_test_blk(1, 0);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+	KUNIT_EXPECT_EQ(test, tmod_buff_push(buff, blk), (size_t)0);
+	tmod_blk_free(blk);
+	tmod_buff_destroy(buff);
+}
+
+static void tmod_buff_bench_push_pop(struct kunit *test)
+{
+	struct tmod_buff *buff;
+	struct tmod_blk *blk;
+	struct tmod_blk *data;
+	u64 start;
+	u64 elapsed;
+	size_t i;
+
+	KUNIT_ASSERT_EQ(test, tmod_buff_init(&buff, TMOD_TEST_BUFFS, TMOD_TEST_BUFF_LEN, 0), 0);
+
+	blk = tmod_test_blk(TMOD_TEST_BUFF_LEN, 0);
+	KUNIT_ASSERT_NOT_NULL(test, blk);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TMOD_TEST_BENCH_ITERS; i++) {
+		tmod_buff_push(buff, blk);
+		tmod_buff_pop(buff, &data);
+	}
+	elapsed = ktime_get_ns() - start;
+
+	kunit_info(test, "bench: tmod_buff push+pop: %d iters, %llu ns/op\n",
+				TMOD_TEST_BENCH_ITERS, div_u64(elapsed, TMOD_TEST_BENCH_ITERS));
+
+	tmod_blk_free(blk);
+	tmod_buff_destroy(buff);
+}
+
+static struct kunit_case tmod_buff_test_cases[] = {
+	KUNIT_CASE(tmod_buff_test_capacity),
+	KUNIT_CASE(tmod_buff_test_oversize),
+	KUNIT_CASE(tmod_buff_test_budget),
+	KUNIT_CASE_SLOW(tmod_buff_bench_push_pop),
+	{}
+};
+
+static struct kunit_suite tmod_buff_test_suite = {
+	.name = "tmod_buff",
+	.test_cases = tmod_buff_test_cases,
+};
+
+/*-------------------------- tmod_worker -----------------------------*/
+
+static void tmod_worker_test_encode(struct kunit *test)
+{
+	char *blk_in;
+	char *blk_out;
+	size_t cursor;
+
+	blk_in = kunit_kzalloc(test, TMOD_TEST_BUFF_LEN, GFP_KERNEL);
+	blk_out = kunit_kzalloc(test, TMOD_TEST_BUFF_LEN, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, blk_in);
+	KUNIT_ASSERT_NOT_NULL(test, blk_out);
+
+	tmod_test_fill(blk_in, TMOD_TEST_BUFF_LEN, 0);
+	tmod_worker_body(blk_in, blk_out, TMOD_TEST_BUFF_LEN, TMOD_TEST_KEY, NULL, NULL);
+
+	for (cursor = 0; cursor < TMOD_TEST_BUFF_LEN; cursor++) {
+		KUNIT_EXPECT_EQ(test, blk_out[cursor], (char)(blk_in[cursor] ^ TMOD_TEST_KEY));
+	}
+}
+
+static void tmod_worker_test_crc(struct kunit *test)
+{
+	static const char check[] = "123456789";
+	char blk_out[sizeof(check) - 1];
+	u32 crc_in = ~0U;
+	u32 crc_out = ~0U;
+
+	/* Standard CRC32C check value */
+	tmod_worker_body(check, blk_out, sizeof(blk_out), TMOD_TEST_KEY, &crc_in, &crc_out);
+	KUNIT_EXPECT_EQ(test, ~crc_in, (u32)0xe3069283);
+	KUNIT_EXPECT_EQ(test, ~crc_out, ~crc32c(~0U, blk_out, sizeof(blk_out)));
+}
+
+static void tmod_worker_bench_body(struct kunit *test)
+{
+	static const size_t blk_lens[] = { 16, 64, 256, 1024 };
+	char *blk_in;
+	char *blk_out;
+	u32 crc_in;
+	u32 crc_out;
+	u64 start;
+	u64 elapsed;
+	size_t i;
+
+	blk_in = kunit_kzalloc(test, blk_lens[ARRAY_SIZE(blk_lens) - 1], GFP_KERNEL);
+	blk_out = kunit_kzalloc(test, blk_lens[ARRAY_SIZE(blk_lens) - 1], GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, blk_in);
+	KUNIT_ASSERT_NOT_NULL(test, blk_out);
+
+	for (i = 0; i < ARRAY_SIZE(blk_lens); i++) {
+		start = ktime_get_ns();
+		tmod_worker_body(blk_in, blk_out, blk_lens[i], TMOD_TEST_KEY, &crc_in, &crc_out);
+		elapsed = ktime_get_ns() - start;
+
+		kunit_info(test, "bench: tmod_worker_body: blk_len %zu, %llu ns/blk, %llu KiB/s\n",
+					blk_lens[i], elapsed,
+					div64_u64((u64)blk_lens[i] * NSEC_PER_SEC, elapsed ? elapsed : 1) >> 10);
+	}
+}
+
+static void tmod_stage_test_lz4(struct kunit *test)
+{
+	struct tmod_stage stage;
+	struct tmod_blk *blk_in;
+	struct tmod_blk *blk_out;
+	char *blk_dec;
+	ssize_t out_len;
+
+	KUNIT_ASSERT_EQ(test, tmod_stage_init(&stage, "lz4", TMOD_TEST_KEY), 0);
+
+	blk_in = tmod_blk_alloc(TMOD_TEST_BUFF_LEN, GFP_KERNEL);
+	blk_out = tmod_blk_alloc(tmod_stage_out_mlen(&stage, TMOD_TEST_BUFF_LEN), GFP_KERNEL);
+	blk_dec = kunit_kzalloc(test, TMOD_TEST_BUFF_LEN, GFP_KERNEL);
+	if (!blk_in || !blk_out || !blk_dec) {
+		tmod_blk_free(blk_in);
+		tmod_blk_free(blk_out);
+		tmod_stage_destroy(&stage);
+		KUNIT_FAIL(test, "unable to allocate blocks\n");
+		return;
+	}
+
+	/* A zero filled block must shrink and decompress back */
+	memset(blk_in->data, 0, TMOD_TEST_BUFF_LEN);
+	blk_in->len = TMOD_TEST_BUFF_LEN;
+
+	out_len = tmod_stage_run(&stage, blk_in, blk_out, false, false);
+	KUNIT_EXPECT_GT(test, out_len, (ssize_t)0);
+	KUNIT_EXPECT_LT(test, out_len, (ssize_t)TMOD_TEST_BUFF_LEN);
+	KUNIT_EXPECT_EQ(test, blk_out->len, (size_t)out_len);
+	KUNIT_EXPECT_EQ(test, LZ4_decompress_safe(blk_out->data, blk_dec, out_len, TMOD_TEST_BUFF_LEN),
+					TMOD_TEST_BUFF_LEN);
+	KUNIT_EXPECT_EQ(test, memcmp(blk_in->data, blk_dec, TMOD_TEST_BUFF_LEN), 0);
+
+	tmod_blk_free(blk_in);
+	tmod_blk_free(blk_out);
+	tmod_stage_destroy(&stage);
+}
+
+/* The XOR stage walks page segments, tags match a contiguous checksum */
+static void tmod_stage_test_xor_pages(struct kunit *test)
+{
+	const size_t len = PAGE_SIZE + 100;
+	struct tmod_stage stage;
+	struct tmod_blk *blk_in;
+	struct tmod_blk *blk_out;
+	char *buf;
+	size_t cursor;
+	size_t bad = 0;
+
+	KUNIT_ASSERT_EQ(test, tmod_stage_init(&stage, "xor", TMOD_TEST_KEY), 0);
+
+	buf = kunit_kzalloc(test, len, GFP_KERNEL);
+	blk_in = tmod_test_blk(len, 3);
+	blk_out = tmod_blk_alloc(tmod_stage_out_mlen(&stage, len), GFP_KERNEL);
+	if (!buf || !blk_in || !blk_out) {
+		tmod_blk_free(blk_in);
+		tmod_blk_free(blk_out);
+		KUNIT_FAIL(test, "unable to allocate blocks\n");
+		return;
+	}
+	KUNIT_EXPECT_GT(test, blk_in->pages_num, 1U);
+
+	KUNIT_EXPECT_EQ(test, tmod_stage_run(&stage, blk_in, blk_out, true, true), (ssize_t)len);
+
+	tmod_test_fill(buf, len, 3);
+	KUNIT_EXPECT_EQ(test, blk_out->crc_in, ~crc32c(~0U, buf, len));
+
+	tmod_blk_to_buf(buf, blk_out, len);
+	KUNIT_EXPECT_EQ(test, blk_out->crc_out, ~crc32c(~0U, buf, len));
+	for (cursor = 0; cursor < len; cursor++) {
+		if (buf[cursor] != (char)(tmod_test_pattern(3, cursor) ^ TMOD_TEST_KEY)) {
+			bad++;
+		}
+	}
+	KUNIT_EXPECT_EQ(test, bad, (size_t)0);
+
+	tmod_blk_free(blk_in);
+	tmod_blk_free(blk_out);
+	tmod_stage_destroy(&stage);
+}
+
+static struct kunit_case tmod_worker_test_cases[] = {
+	KUNIT_CASE(tmod_worker_test_encode),
+	KUNIT_CASE(tmod_worker_test_crc),
+	KUNIT_CASE(tmod_stage_test_lz4),
+	KUNIT_CASE_SLOW(tmod_stage_test_xor_pages),
+	KUNIT_CASE_SLOW(tmod_worker_bench_body),
+	{}
+};
+
+static struct kunit_suite tmod_worker_test_suite = {
+	.name = "tmod_worker",
+	.test_cases = tmod_worker_test_cases,
+};
+
+/*--------------------------- tmod_cache -----------------------------*/
+
+/* Store the XOR of the test block idx, the cache keeps copies */
+static void tmod_test_cache_put(struct tmod_cache *cache, size_t idx)
+{
+	struct tmod_blk *blk_in;
+	struct tmod_blk *blk_out;
+
+	blk_in = tmod_test_blk(TMOD_TEST_BUFF_LEN, idx);
+	blk_out = tmod_test_blk(TMOD_TEST_BUFF_LEN, idx + 1);
+	if (blk_in && blk_out) {
+		tmod_cache_insert(cache, blk_in, blk_out);
+	}
+	tmod_blk_free(blk_in);
+	tmod_blk_free(blk_out);
+}
+
+/* Lookup of the test block idx, true on a hit with the expected output */
+static bool tmod_test_cache_get(struct tmod_cache *cache, size_t idx)
+{
+	struct tmod_blk *blk;
+	struct tmod_blk *hit;
+	struct tmod_blk *expected;
+	bool retval;
+
+	blk = tmod_test_blk(TMOD_TEST_BUFF_LEN, idx);
+	expected = tmod_test_blk(TMOD_TEST_BUFF_LEN, idx + 1);
+	if (!blk || !expected) {
+		tmod_blk_free(blk);
+		tmod_blk_free(expected);
+		return false;
+	}
+
+	hit = tmod_cache_lookup(cache, blk);
+	retval = hit && tmod_blk_equal(hit, expected);
+
+	tmod_blk_free(hit);
+	tmod_blk_free(expected);
+	tmod_blk_free(blk);
+
+	return retval;
+}
+
+static void tmod_cache_test_hit(struct kunit *test)
+{
+	struct tmod_cache_stats stats;
+	struct tmod_cache *cache;
+
+	KUNIT_ASSERT_EQ(test, tmod_cache_init(&cache, TMOD_TEST_CACHE_MEM, TMOD_TEST_KEY), 0);
+
+	KUNIT_EXPECT_FALSE(test, tmod_test_cache_get(cache, 0));
+	tmod_test_cache_put(cache, 0);
+	KUNIT_EXPECT_TRUE(test, tmod_test_cache_get(cache, 0));
+	KUNIT_EXPECT_FALSE(test, tmod_test_cache_get(cache, 1));
+
+	/* A second insert of the same block is dropped */
+	tmod_test_cache_put(cache, 0);
+
+	tmod_cache_get_stats(cache, &stats);
+	KUNIT_EXPECT_EQ(test, stats.hits, 1ULL);
+	KUNIT_EXPECT_EQ(test, stats.misses, 2ULL);
+	KUNIT_EXPECT_EQ(test, stats.entries, (size_t)1);
+	/* Charged like the blocks, not just their data */
+	KUNIT_EXPECT_GE(test, stats.mem, 2 * tmod_blk_size(TMOD_TEST_BUFF_LEN));
+
+	tmod_cache_destroy(cache);
+}
+
+/* Room for two entries: the least recently used one goes */
+static void tmod_cache_test_evict(struct kunit *test)
+{
+	struct tmod_cache_stats stats;
+	struct tmod_cache *cache;
+	size_t ent_mem;
+
+	KUNIT_ASSERT_EQ(test, tmod_cache_init(&cache, TMOD_TEST_CACHE_MEM, TMOD_TEST_KEY), 0);
+	tmod_test_cache_put(cache, 0);
+	tmod_cache_get_stats(cache, &stats);
+	ent_mem = stats.mem;
+	tmod_cache_destroy(cache);
+	KUNIT_ASSERT_GT(test, ent_mem, (size_t)0);
+
+	KUNIT_ASSERT_EQ(test, tmod_cache_init(&cache, 2 * ent_mem, TMOD_TEST_KEY), 0);
+
+	tmod_test_cache_put(cache, 0);
+	tmod_test_cache_put(cache, 1);
+	KUNIT_EXPECT_TRUE(test, tmod_test_cache_get(cache, 0));
+	tmod_test_cache_put(cache, 2);
+
+	KUNIT_EXPECT_TRUE(test, tmod_test_cache_get(cache, 0));
+	KUNIT_EXPECT_FALSE(test, tmod_test_cache_get(cache, 1));
+	KUNIT_EXPECT_TRUE(test, tmod_test_cache_get(cache, 2));
+
+	tmod_cache_get_stats(cache, &stats);
+	KUNIT_EXPECT_EQ(test, stats.evictions, 1ULL);
+	KUNIT_EXPECT_EQ(test, stats.entries, (size_t)2);
+	KUNIT_EXPECT_LE(test, stats.mem, 2 * ent_mem);
+
+	tmod_cache_destroy(cache);
+}
+
+static struct kunit_case tmod_cache_test_cases[] = {
+	KUNIT_CASE(tmod_cache_test_hit),
+	KUNIT_CASE(tmod_cache_test_evict),
+	{}
+};
+
+static struct kunit_suite tmod_cache_test_suite = {
+	.name = "tmod_cache",
+	.test_cases = tmod_cache_test_cases,
+};
+
+/*--------------------------- tmod_cdev ------------------------------*/
+
+struct tmod_test_producer {
+	struct cdev_ctx *ctx;
+	size_t blks_uniq;
+	int retval;
+	struct completion done;
+};
+
+static int tmod_test_producer_body(void *data)
+{
+	struct tmod_test_producer *prod;
+	struct tmod_blk *blk;
+	size_t i;
+
+	prod = (struct tmod_test_producer *)data;
+
+	for (i = 0; i < TMOD_TEST_STRESS_BLKS && !kthread_should_stop(); i++) {
+		blk = tmod_test_blk(TMOD_TEST_STRESS_MLEN, i % prod->blks_uniq);
+		if (!blk) {
+			prod->retval = -ENOMEM;
+			break;
+		}
+
+		prod->retval = tmod_cdev_submit(prod->ctx, blk);
+		if (prod->retval) {
+			tmod_blk_free(blk);
+			break;
+		}
+	}
+
+	complete(&prod->done);
+
+	/* Exit only once stopped, so that kthread_stop() never races the exit */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static struct tmod_cdev_cfg tmod_test_cfg(const char *stages, bool tag)
+{
+	struct tmod_cdev_cfg cfg = {
+		.name		= "enc_dev_test",
+		.blk_mnum	= TMOD_TEST_STRESS_MNUM,
+		.blk_mlen	= TMOD_TEST_STRESS_MLEN,
+		.key		= TMOD_TEST_KEY,
+		.tag		= tag,
+		.stages		= stages,
+	};
+
+	return cfg;
+}
+
+/*
+ * One producer thread feeding the pipeline while the test thread
+ * drains it: checks ordering and content under constant backpressure.
+ * Every stage is a XOR: mask is the key after all of them. The block
+ * patterns repeat every blks_uniq blocks. If stats is given, the cache
+ * counters are read back before the context goes away.
+*/
+static void tmod_test_pipeline(struct kunit *test, const struct tmod_cdev_cfg *cfg, char mask,
+								size_t blks_uniq, struct tmod_cache_stats *stats)
+{
+	struct cdev_ctx *ctx;
+	struct tmod_test_producer *prod;
+	struct task_struct *prod_p;
+	ssize_t blk_len;
+	struct tmod_blk *blk;
+	char buf[TMOD_TEST_STRESS_MLEN];
+	size_t blks_ok = 0;
+	size_t i;
+	size_t cursor;
+	u64 start;
+	u64 elapsed;
+
+	prod = kunit_kzalloc(test, sizeof(*prod), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, prod);
+
+	KUNIT_ASSERT_EQ(test, tmod_cdev_create(&ctx, cfg), 0);
+
+	prod->ctx = ctx;
+	prod->blks_uniq = blks_uniq;
+	init_completion(&prod->done);
+
+	start = ktime_get_ns();
+
+	prod_p = kthread_run(tmod_test_producer_body, prod, "tmod_test_producer");
+	if (IS_ERR(prod_p)) {
+		tmod_cdev_destroy(ctx);
+		KUNIT_FAIL(test, "unable to start producer thread\n");
+		return;
+	}
+
+	for (i = 0; i < TMOD_TEST_STRESS_BLKS; ) {
+		blk_len = tmod_cdev_collect(ctx, &blk);
+		if (blk_len < 0) {
+			KUNIT_FAIL(test, "collect failed: %zd\n", blk_len);
+			break;
+		}
+
+		/* Nothing in flight: the producer is either behind or gone */
+		if (blk_len == 0) {
+			if (completion_done(&prod->done)) {
+				break;
+			}
+			usleep_range(100, 200);
+			continue;
+		}
+
+		KUNIT_EXPECT_EQ(test, (size_t)blk_len, (size_t)TMOD_TEST_STRESS_MLEN);
+		tmod_blk_to_buf(buf, blk, min_t(size_t, blk_len, sizeof(buf)));
+		for (cursor = 0; cursor < sizeof(buf); cursor++) {
+			if (buf[cursor] != (char)(tmod_test_pattern(i % blks_uniq, cursor) ^ mask)) {
+				break;
+			}
+		}
+		if (cursor == sizeof(buf)) {
+			blks_ok++;
+		}
+
+		tmod_blk_free(blk);
+		i++;
+	}
+
+	/*
+	 * After a failed collect the producer may wait on a full queue:
+	 * stopping it interrupts the push, before the queues go away.
+	 */
+	kthread_stop(prod_p);
+	wait_for_completion(&prod->done);
+	elapsed = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, prod->retval, 0);
+	KUNIT_EXPECT_EQ(test, blks_ok, (size_t)TMOD_TEST_STRESS_BLKS);
+
+	kunit_info(test, "bench: pipeline %s, poll %lu us: %d blks of %d bytes, %llu ns/blk\n",
+				cfg->stages, cfg->poll_us, TMOD_TEST_STRESS_BLKS, TMOD_TEST_STRESS_MLEN,
+				div_u64(elapsed, TMOD_TEST_STRESS_BLKS));
+
+	if (stats) {
+		KUNIT_EXPECT_EQ(test, tmod_cdev_cache_stats(ctx, stats), 0);
+	}
+
+	tmod_cdev_destroy(ctx);
+}
+
+static void tmod_cdev_test_stress(struct kunit *test)
+{
+	struct tmod_cdev_cfg cfg = tmod_test_cfg("xor", false);
+
+	tmod_test_pipeline(test, &cfg, TMOD_TEST_KEY, TMOD_TEST_STRESS_BLKS, NULL);
+}
+
+/* Two overlapped stages: ns/blk should stay close to the single stage one */
+static void tmod_cdev_test_stress_stages(struct kunit *test)
+{
+	struct tmod_cdev_cfg cfg = tmod_test_cfg("xor,xor", false);
+
+	tmod_test_pipeline(test, &cfg, 0, TMOD_TEST_STRESS_BLKS, NULL);
+}
+
+/* Same load with busy polling: compare ns/blk with the sleeping run */
+static void tmod_cdev_test_stress_poll(struct kunit *test)
+{
+	struct tmod_cdev_cfg cfg = tmod_test_cfg("xor", false);
+
+	cfg.poll_us = TMOD_TEST_POLL_US;
+	tmod_test_pipeline(test, &cfg, TMOD_TEST_KEY, TMOD_TEST_STRESS_BLKS, NULL);
+}
+
+/* Feed known inter-arrival gaps: when does spinning stop and start again */
+static void tmod_cdev_test_poll_tuning(struct kunit *test)
+{
+	const u64 poll_ns = TMOD_TEST_POLL_US * NSEC_PER_USEC;
+	u64 avg = poll_ns;
+	int i;
+
+	/* A steady fast stream spins for twice its gap */
+	for (i = 0; i < 64; i++) {
+		avg = tmod_cdev_poll_avg(avg, poll_ns / 10, poll_ns);
+	}
+	KUNIT_EXPECT_GT(test, tmod_cdev_poll_budget(avg, poll_ns), poll_ns / 10);
+	KUNIT_EXPECT_LT(test, tmod_cdev_poll_budget(avg, poll_ns), poll_ns / 4);
+
+	/* A single idle pause (10 s) does not stop it */
+	avg = tmod_cdev_poll_avg(avg, 10ULL * NSEC_PER_SEC, poll_ns);
+	KUNIT_EXPECT_GT(test, tmod_cdev_poll_budget(avg, poll_ns), 0ULL);
+
+	/* A slow stream does, within a few arrivals */
+	for (i = 0; i < 8 && tmod_cdev_poll_budget(avg, poll_ns); i++) {
+		avg = tmod_cdev_poll_avg(avg, 10ULL * NSEC_PER_SEC, poll_ns);
+	}
+	KUNIT_EXPECT_EQ(test, tmod_cdev_poll_budget(avg, poll_ns), 0ULL);
+	for (i = 0; i < 64; i++) {
+		avg = tmod_cdev_poll_avg(avg, 10ULL * NSEC_PER_SEC, poll_ns);
+	}
+	KUNIT_EXPECT_LE(test, avg, 2 * poll_ns);
+
+	/* Back to a burst: spinning again within a few arrivals, not tens */
+	for (i = 0; i < 8 && !tmod_cdev_poll_budget(avg, poll_ns); i++) {
+		avg = tmod_cdev_poll_avg(avg, poll_ns / 10, poll_ns);
+	}
+	KUNIT_EXPECT_LT(test, i, 8);
+	KUNIT_EXPECT_GT(test, tmod_cdev_poll_budget(avg, poll_ns), 0ULL);
+}
+
+/* Repeated blocks: hits skip the stages, compare ns/blk with stress */
+static void tmod_cdev_test_stress_cache(struct kunit *test)
+{
+	struct tmod_cdev_cfg cfg = tmod_test_cfg("xor,xor", false);
+	struct cdev_ctx *ctx;
+	struct tmod_cache_stats stats;
+
+	cfg.cache_mem = TMOD_TEST_CACHE_MEM;
+	memset(&stats, 0, sizeof(stats));
+	tmod_test_pipeline(test, &cfg, 0, TMOD_TEST_CACHE_UNIQ, &stats);
+
+	/*
+	 * When a block is looked up, at most the blocks in the two queues
+	 * before the last stage and in both workers (6) are not cached yet:
+	 * with 8 distinct blocks only the first occurrences miss.
+	 */
+	KUNIT_EXPECT_GE(test, stats.hits, (u64)(TMOD_TEST_STRESS_BLKS - TMOD_TEST_CACHE_UNIQ));
+	KUNIT_EXPECT_EQ(test, stats.misses, (u64)TMOD_TEST_CACHE_UNIQ);
+
+	/* Off by default */
+	cfg = tmod_test_cfg("xor", false);
+	KUNIT_ASSERT_EQ(test, tmod_cdev_create(&ctx, &cfg), 0);
+	KUNIT_EXPECT_EQ(test, tmod_cdev_cache_stats(ctx, &stats), -ENODEV);
+	tmod_cdev_destroy(ctx);
+}
+
+/*
+ * Collect blocks until blks came back (or a timeout), checking that
+ * their concatenation is the XOR of the pattern stream of block 0.
+ * Returns the stream length.
+*/
+static size_t tmod_test_co_collect(struct kunit *test, struct cdev_ctx *ctx,
+									const size_t *blk_lens, size_t blks)
+{
+	struct tmod_blk *blk;
+	char buf[TMOD_TEST_STRESS_MLEN];
+	ssize_t blk_len;
+	size_t stream = 0;
+	size_t cursor;
+	size_t i;
+	int tries;
+
+	for (i = 0; i < blks; i++) {
+		for (tries = 0; tries < 1000; tries++) {
+			blk_len = tmod_cdev_collect(ctx, &blk);
+			if (blk_len) {
+				break;
+			}
+			usleep_range(100, 200);
+		}
+		if (blk_len <= 0) {
+			KUNIT_FAIL(test, "block %zu not collected: %zd\n", i, blk_len);
+			break;
+		}
+
+		KUNIT_EXPECT_EQ(test, (size_t)blk_len, blk_lens[i]);
+		blk_len = min_t(size_t, blk_len, sizeof(buf));
+		tmod_blk_to_buf(buf, blk, blk_len);
+		for (cursor = 0; cursor < (size_t)blk_len; cursor++) {
+			KUNIT_EXPECT_EQ(test, buf[cursor],
+							(char)(tmod_test_pattern(0, stream + cursor) ^ TMOD_TEST_KEY));
+		}
+		stream += blk_len;
+
+		tmod_blk_free(blk);
+	}
+
+	return stream;
+}
+
+/* Small writes fill blocks, the rest goes on flush, the stream is unchanged */
+static void tmod_cdev_test_coalesce(struct kunit *test)
+{
+	static const size_t blk_lens[] = { TMOD_TEST_STRESS_MLEN, 6, 10, 10 };
+	static const size_t write_lens[] = { 4, 4, 4, 4, 3, 3 };
+	struct tmod_cdev_cfg cfg;
+	struct cdev_ctx *ctx;
+	char stream[64];
+	size_t off = 0;
+	size_t i;
+
+	tmod_test_fill(stream, sizeof(stream), 0);
+
+	cfg = tmod_test_cfg("xor", false);
+	cfg.coalesce_us = TMOD_TEST_CO_US;
+	KUNIT_ASSERT_EQ(test, tmod_cdev_create(&ctx, &cfg), 0);
+
+	/* Four writes make one full block, two more wait for the flush */
+	for (i = 0; i < ARRAY_SIZE(write_lens); i++) {
+		KUNIT_EXPECT_EQ(test, tmod_cdev_coalesce(ctx, stream + off, write_lens[i]),
+						(ssize_t)write_lens[i]);
+		off += write_lens[i];
+	}
+	KUNIT_EXPECT_EQ(test, tmod_cdev_flush(ctx), 0);
+
+	/* A write that does not fit sends the staged bytes first */
+	KUNIT_EXPECT_EQ(test, tmod_cdev_coalesce(ctx, stream + off, 10), (ssize_t)10);
+	KUNIT_EXPECT_EQ(test, tmod_cdev_coalesce(ctx, stream + off + 10, 10), (ssize_t)10);
+	off += 20;
+	KUNIT_EXPECT_EQ(test, tmod_cdev_flush(ctx), 0);
+
+	KUNIT_EXPECT_EQ(test, tmod_test_co_collect(test, ctx, blk_lens, ARRAY_SIZE(blk_lens)), off);
+
+	KUNIT_EXPECT_EQ(test, tmod_cdev_coalesce(ctx, stream, TMOD_TEST_STRESS_MLEN + 1),
+					(ssize_t)-EINVAL);
+
+	tmod_cdev_destroy(ctx);
+
+	/* Off by default */
+	cfg = tmod_test_cfg("xor", false);
+	KUNIT_ASSERT_EQ(test, tmod_cdev_create(&ctx, &cfg), 0);
+	KUNIT_EXPECT_EQ(test, tmod_cdev_coalesce(ctx, stream, 1), (ssize_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, tmod_cdev_flush(ctx), 0);
+	tmod_cdev_destroy(ctx);
+}
+
+/* Staged bytes go out on their own once the timeout expires */
+static void tmod_cdev_test_coalesce_timer(struct kunit *test)
+{
+	static const size_t blk_lens[] = { 5 };
+	struct tmod_cdev_cfg cfg;
+	struct cdev_ctx *ctx;
+	char stream[5];
+
+	tmod_test_fill(stream, sizeof(stream), 0);
+
+	cfg = tmod_test_cfg("xor", false);
+	cfg.coalesce_us = TMOD_TEST_CO_SHORT_US;
+	KUNIT_ASSERT_EQ(test, tmod_cdev_create(&ctx, &cfg), 0);
+
+	KUNIT_EXPECT_EQ(test, tmod_cdev_coalesce(ctx, stream, sizeof(stream)), (ssize_t)sizeof(stream));
+
+	/* No flush: collect polls until the timer has dispatched the block */
+	KUNIT_EXPECT_EQ(test, tmod_test_co_collect(test, ctx, blk_lens, 1), sizeof(stream));
+
+	/* Staged bytes left at destroy are dropped */
+	KUNIT_EXPECT_EQ(test, tmod_cdev_coalesce(ctx, stream, 1), (ssize_t)1);
+	tmod_cdev_destroy(ctx);
+}
+
+/* A few staged bytes are queued and cached in a block of their size */
+static void tmod_cdev_test_coalesce_shrink(struct kunit *test)
+{
+	static const size_t blk_lens[] = { 5 };
+	struct tmod_cache_stats stats;
+	struct tmod_cdev_cfg cfg;
+	struct cdev_ctx *ctx;
+	char stream[5];
+
+	tmod_test_fill(stream, sizeof(stream), 0);
+
+	cfg = tmod_test_cfg("xor", false);
+	cfg.blk_mlen = 16 * PAGE_SIZE;
+	cfg.cache_mem = TMOD_TEST_CACHE_MEM;
+	cfg.coalesce_us = TMOD_TEST_CO_US;
+	KUNIT_ASSERT_EQ(test, tmod_cdev_create(&ctx, &cfg), 0);
+
+	KUNIT_EXPECT_EQ(test, tmod_cdev_coalesce(ctx, stream, sizeof(stream)), (ssize_t)sizeof(stream));
+	KUNIT_EXPECT_EQ(test, tmod_cdev_flush(ctx), 0);
+	KUNIT_EXPECT_EQ(test, tmod_test_co_collect(test, ctx, blk_lens, 1), sizeof(stream));
+
+	/* Both copies in the cache are sized to the data */
+	KUNIT_EXPECT_EQ(test, tmod_cdev_cache_stats(ctx, &stats), 0);
+	KUNIT_EXPECT_EQ(test, stats.entries, (size_t)1);
+	KUNIT_EXPECT_LT(test, stats.mem, tmod_blk_size(PAGE_SIZE));
+
+	tmod_cdev_destroy(ctx);
+}
+
+static void tmod_cdev_test_bad_stages(struct kunit *test)
+{
+	struct tmod_cdev_cfg cfg;
+	struct cdev_ctx *ctx;
+
+	cfg = tmod_test_cfg("xor,nope", false);
+	KUNIT_EXPECT_EQ(test, tmod_cdev_create(&ctx, &cfg), -EINVAL);
+
+	cfg = tmod_test_cfg("", false);
+	KUNIT_EXPECT_EQ(test, tmod_cdev_create(&ctx, &cfg), -EINVAL);
+
+	cfg = tmod_test_cfg("xor,xor,xor,xor,xor", false);
+	KUNIT_EXPECT_EQ(test, tmod_cdev_create(&ctx, &cfg), -EINVAL);
+}
+
+/*
+ * A tagged block comes back with crc_in matching the block written and
+ * crc_out matching the data returned, whatever the stage chain
+ */
+static void tmod_cdev_test_tag_stages(struct kunit *test, const char *stages)
+{
+	struct tmod_cdev_cfg cfg;
+	struct cdev_ctx *ctx;
+	struct tmod_blk *blk;
+	char *buf;
+	ssize_t blk_len;
+	u32 crc_in;
+
+	cfg = tmod_test_cfg(stages, true);
+	KUNIT_ASSERT_EQ(test, tmod_cdev_create(&ctx, &cfg), 0);
+
+	/* Room for the worst case output of lz4 */
+	buf = kunit_kzalloc(test, 2 * TMOD_TEST_STRESS_MLEN, GFP_KERNEL);
+	blk = tmod_test_blk(TMOD_TEST_STRESS_MLEN, 0);
+	if (!buf || !blk) {
+		tmod_blk_free(blk);
+		tmod_cdev_destroy(ctx);
+		KUNIT_FAIL(test, "unable to allocate block\n");
+		return;
+	}
+	tmod_test_fill(buf, TMOD_TEST_STRESS_MLEN, 0);
+	crc_in = ~crc32c(~0U, buf, TMOD_TEST_STRESS_MLEN);
+
+	/* The context owns blk after submit */
+	KUNIT_EXPECT_EQ(test, tmod_cdev_submit(ctx, blk), 0);
+
+	blk_len = tmod_cdev_collect(ctx, &blk);
+	KUNIT_EXPECT_GT(test, blk_len, (ssize_t)0);
+	if (blk_len > 0) {
+		tmod_blk_to_buf(buf, blk, blk_len);
+		KUNIT_EXPECT_EQ(test, blk->crc_in, crc_in);
+		KUNIT_EXPECT_EQ(test, blk->crc_out, ~crc32c(~0U, buf, blk_len));
+		tmod_blk_free(blk);
+	}
+
+	tmod_cdev_destroy(ctx);
+}
+
+static void tmod_cdev_test_tag(struct kunit *test)
+{
+	tmod_cdev_test_tag_stages(test, "xor");
+	tmod_cdev_test_tag_stages(test, "lz4,xor");
+}
+
+/* A block lost in a stage is reported in its place, the next one follows */
+static void tmod_cdev_test_lost(struct kunit *test)
+{
+	struct tmod_cdev_cfg cfg;
+	struct cdev_ctx *ctx;
+	struct tmod_blk *blk;
+	ssize_t blk_len;
+	int i;
+
+	cfg = tmod_test_cfg("xor,xor", false);
+	KUNIT_ASSERT_EQ(test, tmod_cdev_create(&ctx, &cfg), 0);
+
+	for (i = 0; i < 2; i++) {
+		blk = tmod_test_blk(TMOD_TEST_STRESS_MLEN, i);
+		if (!blk) {
+			tmod_cdev_destroy(ctx);
+			KUNIT_FAIL(test, "unable to allocate block\n");
+			return;
+		}
+		/* As marked by a failing first stage */
+		if (!i) {
+			blk->err = -EIO;
+		}
+		KUNIT_EXPECT_EQ(test, tmod_cdev_submit(ctx, blk), 0);
+	}
+
+	KUNIT_EXPECT_EQ(test, tmod_cdev_collect(ctx, &blk), (ssize_t)-EIO);
+
+	blk_len = tmod_cdev_collect(ctx, &blk);
+	KUNIT_EXPECT_EQ(test, blk_len, (ssize_t)TMOD_TEST_STRESS_MLEN);
+	if (blk_len > 0) {
+		tmod_blk_free(blk);
+	}
+
+	/* Nothing left in flight */
+	KUNIT_EXPECT_EQ(test, tmod_cdev_collect(ctx, &blk), (ssize_t)0);
+
+	tmod_cdev_destroy(ctx);
+}
+
+static struct kunit_case tmod_cdev_test_cases[] = {
+	KUNIT_CASE(tmod_cdev_test_tag),
+	KUNIT_CASE(tmod_cdev_test_bad_stages),
+	KUNIT_CASE(tmod_cdev_test_lost),
+	KUNIT_CASE(tmod_cdev_test_coalesce),
+	KUNIT_CASE(tmod_cdev_test_coalesce_timer),
+	KUNIT_CASE(tmod_cdev_test_coalesce_shrink),
+	KUNIT_CASE_SLOW(tmod_cdev_test_stress),
+	KUNIT_CASE_SLOW(tmod_cdev_test_stress_stages),
+	KUNIT_CASE_SLOW(tmod_cdev_test_stress_poll),
+	KUNIT_CASE(tmod_cdev_test_poll_tuning),
+	KUNIT_CASE_SLOW(tmod_cdev_test_stress_cache),
+	{}
+};
+
+static struct kunit_suite tmod_cdev_test_suite = {
+	.name = "tmod_cdev",
+	.test_cases = tmod_cdev_test_cases,
+};
+
+kunit_test_suites(&tmod_blk_test_suite, &tmod_buff_test_suite,
+					&tmod_worker_test_suite, &tmod_cache_test_suite,
+					&tmod_cdev_test_suite);
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#ifndef TMOD_UAPI_H
+#define TMOD_UAPI_H
+
+#include <linux/types.h>
+
+/*
+ * Record header prepended to every block returned by read() when the
+ * module is loaded with tag=1. Both checksums are standard CRC32C
+ * (Castagnoli, reflected, init and final XOR 0xffffffff): crc_in by the
+ * first stage over the block as written, crc_out by the last stage over
+ * the data returned, whatever the stages in between. The XOR stage
+ * makes one crc32c() call per segment, after the XOR loop over it.
+ * If the read() buffer is shorter than the record the data is cut,
+ * len always holds the full block length.
+ */
+struct tmod_rec_hdr {
+	__u32 len;			/* data bytes following the header */
+	__u32 crc_in;		/* CRC32C of the block passed to write() */
+	__u32 crc_out;		/* CRC32C of the data following the header */
+};
+
+#endif /* TMOD_UAPI_H */
@@ -10,10 +10,12 @@
 
 #include <linux/delay.h>		/* usleep_range() */
 #include <linux/types.h>
+#include <linux/crc32c.h>
 
 #include "tmod_worker.h"
 
-void tmod_worker_body(const char *blk_in, char *blk_out, size_t len, char key)
+void tmod_worker_body(const char *blk_in, char *blk_out, size_t len, char key,
+						u32 *crc_in, u32 *crc_out)
 {
 	size_t cursor = 0;
 	
@@ -27,6 +29,15 @@ void tmod_worker_body(const char *blk_in, char *blk_out, size_t len, char key)
 		usleep_range(100, 101);
 		
 		blk_out[cursor] = blk_in[cursor] ^ key;
+		
 		cursor++;
 	}
+	
+	/* Checksums: one crc32c() call per chunk, a second pass after the loop */
+	if (crc_in) {
+		*crc_in = crc32c(*crc_in, blk_in, len);
+	}
+	if (crc_out) {
+		*crc_out = crc32c(*crc_out, blk_out, len);
+	}
 }
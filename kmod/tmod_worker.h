@@ -11,6 +11,14 @@
 #ifndef TMOD_WORKER_H
 #define TMOD_WORKER_H
 
-void tmod_worker_body(const char *blk_in, char *blk_out, size_t len, char key);
+#include <linux/types.h>
+
+/*
+ * If not NULL, crc_in and crc_out are running CRC32C values updated with
+ * the input and output bytes (no initial or final inversion here, so a
+ * block can be encoded one segment at a time)
+ */
+void tmod_worker_body(const char *blk_in, char *blk_out, size_t len, char key,
+						u32 *crc_in, u32 *crc_out);
 
 #endif /* TMOD_WORKER_H */
@@ -0,0 +1,872 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
+
+#include "../kmod/tmod_uapi.h"
+#include "libtmod.h"
+
+#define TMOD_DEV_PATH		"/dev/enc_dev"
+#define TMOD_PARAM_PATH		"/sys/module/tmod_enc/parameters/"
+
+/* Blocks per readv()/writev() */
+#define TMOD_BATCH_MAX		64
+
+/* Upper bound of the kernel header of a queued block (struct tmod_blk) */
+#define TMOD_BLK_OVERHEAD	128
+
+/* Pool defaults: 4 MiB whatever blk_mlen, requests may span many blocks */
+#define TMOD_POOL_BUFS		16
+#define TMOD_POOL_BUF_LEN	(256 * 1024)
+
+struct tmod_req {
+	const char *in;
+	char *out;
+	size_t len;
+
+	/* Bytes written to and read back from the device */
+	size_t wr_off;
+	size_t rd_off;
+
+	int status;
+	tmod_cb_t cb;
+	void *arg;
+
+	struct tmod_req *next;
+};
+
+struct tmod_future {
+	pthread_mutex_t lock;
+	pthread_cond_t done_cv;
+	int done;
+	int status;
+};
+
+struct tmod_ctx {
+	int fd;
+	int own_fd;
+	size_t blk_mnum;
+	size_t blk_mlen;
+	int tag;
+
+	pthread_mutex_t lock;
+	pthread_cond_t write_cv;
+	pthread_cond_t read_cv;
+
+	/* Requests in order: head completes next, wr_req is written next */
+	struct tmod_req *head;
+	struct tmod_req *tail;
+	struct tmod_req *wr_req;
+
+	/* Blocks written to and read back from the device */
+	unsigned long blks_wr;
+	unsigned long blks_rd;
+
+	int stop;
+	int err;
+
+	pthread_t writer_tr;
+	pthread_t reader_tr;
+
+	/* Buffer pool */
+	pthread_mutex_t pool_lock;
+	char *pool_mem;
+	void **pool;
+	unsigned char *pool_out;	/* per buffer, set while handed out */
+	size_t pool_free;
+	size_t pool_bufs;
+	size_t pool_buf_len;
+
+	/* Staging for tagged records */
+	char *rec;
+};
+
+/*---------------------------- Helpers -------------------------------*/
+
+/* Read a module parameter from sysfs */
+static int read_param(const char *name, char *val, size_t len)
+{
+	char path[128];
+	ssize_t retval;
+	int fd;
+
+	snprintf(path, sizeof(path), TMOD_PARAM_PATH "%s", name);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	retval = read(fd, val, len - 1);
+	close(fd);
+	if (retval <= 0) {
+		return -EIO;
+	}
+	val[retval] = '\0';
+
+	return 0;
+}
+
+/* kmalloc() size class of an inline block: 96, 192 or a power of two */
+static size_t slab_size(size_t size)
+{
+	size_t cls = 8;
+
+	if (size > 64 && size <= 96) {
+		return 96;
+	}
+	if (size > 128 && size <= 192) {
+		return 192;
+	}
+	while (cls < size) {
+		cls <<= 1;
+	}
+
+	return cls;
+}
+
+/*
+ * Full blocks that surely fit the first queue, so that writev() never
+ * waits on the completion thread: blk_mnum, or the queue_kb budget over
+ * an upper bound of the kernel memory of a block, capped by blk_slots.
+ * Blocks fitting a page with their header are stored inline in a single
+ * slab object, larger ones as a vector of pages.
+ */
+static int queue_blks(size_t blk_mlen, size_t *blks)
+{
+	unsigned long queue_kb = 0;
+	unsigned long slots = 0;
+	size_t blk_mem;
+	long page;
+	char val[32];
+
+	if (read_param("blk_mnum", val, sizeof(val)) < 0) {
+		return -ENODEV;
+	}
+	*blks = strtoul(val, NULL, 10);
+
+	if (!read_param("queue_kb", val, sizeof(val))) {
+		queue_kb = strtoul(val, NULL, 10);
+	}
+	if (!read_param("blk_slots", val, sizeof(val))) {
+		slots = strtoul(val, NULL, 10);
+	}
+
+	if (queue_kb) {
+		page = sysconf(_SC_PAGESIZE);
+		if (blk_mlen + TMOD_BLK_OVERHEAD <= (size_t)page) {
+			blk_mem = slab_size(blk_mlen + TMOD_BLK_OVERHEAD);
+		} else {
+			blk_mem = (blk_mlen + page - 1) / page * (page + sizeof(void *)) + TMOD_BLK_OVERHEAD;
+		}
+		*blks = queue_kb * 1024 / blk_mem;
+	}
+	if (slots && slots < *blks) {
+		*blks = slots;
+	}
+
+	/* An empty queue always takes a block */
+	if (!*blks) {
+		*blks = 1;
+	}
+
+	return 0;
+}
+
+/* Bitwise CRC32C (Castagnoli, reflected), same parameters as the module */
+static __u32 crc32c(const char *data, size_t len)
+{
+	__u32 crc = ~0U;
+	size_t cursor;
+	int bit;
+
+	for (cursor = 0; cursor < len; cursor++) {
+		crc ^= (unsigned char)data[cursor];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+static size_t blk_cut(const struct tmod_ctx *ctx, size_t left)
+{
+	return left > ctx->blk_mlen ? ctx->blk_mlen : left;
+}
+
+static void run_callbacks(struct tmod_req *done)
+{
+	struct tmod_req *req;
+
+	while (done) {
+		req = done;
+		done = done->next;
+
+		if (req->cb) {
+			req->cb(req->arg, req->status, req->out, req->len);
+		}
+		free(req);
+	}
+}
+
+/* Detach all requests failing them, called with the lock held */
+static struct tmod_req *fail_all(struct tmod_ctx *ctx, int status)
+{
+	struct tmod_req *done;
+	struct tmod_req *req;
+
+	done = ctx->head;
+	for (req = done; req; req = req->next) {
+		req->status = status;
+	}
+
+	ctx->head = NULL;
+	ctx->tail = NULL;
+	ctx->wr_req = NULL;
+
+	return done;
+}
+
+/*---------------------------- Threads -------------------------------*/
+
+/*
+ * Write blocks of the queued requests, many per writev(). Only read()
+ * and write() exist on the device: there is no batch ioctl, and io_uring
+ * on a file without read_iter/nowait support just punts every request
+ * to its own worker threads. Batched readv()/writev() is the fastest
+ * path available, and the only one until the device offers another.
+ */
+static void *writer_body(void *ptr)
+{
+	struct tmod_ctx *ctx;
+	struct tmod_req *req;
+	struct iovec iov[TMOD_BATCH_MAX];
+	unsigned long room;
+	size_t off;
+	ssize_t len;
+	int cnt;
+	int i;
+
+	ctx = (struct tmod_ctx *)ptr;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		while (!ctx->err && ((!ctx->wr_req && !ctx->stop) ||
+				(ctx->wr_req && ctx->blks_wr - ctx->blks_rd >= ctx->blk_mnum))) {
+			pthread_cond_wait(&ctx->write_cv, &ctx->lock);
+		}
+		if (ctx->err || !ctx->wr_req) {
+			break;
+		}
+
+		/* Blocks beyond the first queue would stall writev() until read */
+		room = ctx->blk_mnum - (ctx->blks_wr - ctx->blks_rd);
+		if (room > TMOD_BATCH_MAX) {
+			room = TMOD_BATCH_MAX;
+		}
+
+		/* One iovec per block, from the current write position on */
+		req = ctx->wr_req;
+		off = req->wr_off;
+		for (cnt = 0; req && cnt < (int)room; cnt++) {
+			iov[cnt].iov_base = (void *)(req->in + off);
+			iov[cnt].iov_len = blk_cut(ctx, req->len - off);
+
+			off += iov[cnt].iov_len;
+			if (off == req->len) {
+				req = req->next;
+				off = 0;
+			}
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		len = writev(ctx->fd, iov, cnt);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ctx->err = -errno;
+			pthread_cond_signal(&ctx->read_cv);
+			break;
+		}
+
+		/* Account the blocks taken by the device */
+		for (i = 0; i < cnt && (size_t)len >= iov[i].iov_len; i++) {
+			len -= iov[i].iov_len;
+
+			ctx->wr_req->wr_off += iov[i].iov_len;
+			if (ctx->wr_req->wr_off == ctx->wr_req->len) {
+				ctx->wr_req = ctx->wr_req->next;
+			}
+			ctx->blks_wr++;
+		}
+
+		/* The device never takes part of a block */
+		if (len) {
+			ctx->err = -EIO;
+		}
+
+		pthread_cond_signal(&ctx->read_cv);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return NULL;
+}
+
+/* Read one tagged record, check it and strip the header */
+static ssize_t read_tagged(struct tmod_ctx *ctx, struct iovec *iov, int *status)
+{
+	struct tmod_rec_hdr *hdr;
+	ssize_t len;
+
+	len = read(ctx->fd, ctx->rec, sizeof(*hdr) + ctx->blk_mlen);
+	if (len < 0 && errno == EIO) {
+		/* Block lost in a stage: fail its request, go on with the next */
+		*status = -EIO;
+		return (ssize_t)iov->iov_len;
+	}
+	if (len < 0) {
+		return -errno;
+	}
+
+	hdr = (struct tmod_rec_hdr *)ctx->rec;
+	if ((size_t)len != sizeof(*hdr) + iov->iov_len || hdr->len != iov->iov_len) {
+		return -EPROTO;
+	}
+
+	memcpy(iov->iov_base, ctx->rec + sizeof(*hdr), iov->iov_len);
+
+	if (crc32c(iov->iov_base, iov->iov_len) != hdr->crc_out) {
+		*status = -EBADMSG;
+	}
+
+	return (ssize_t)iov->iov_len;
+}
+
+/* Account a block read back, detaching its request once complete */
+static void blk_done(struct tmod_ctx *ctx, size_t len, int status,
+						struct tmod_req ***done_tail)
+{
+	struct tmod_req *req;
+
+	ctx->blks_rd++;
+
+	req = ctx->head;
+	req->rd_off += len;
+	if (status) {
+		req->status = status;
+	}
+
+	if (req->rd_off == req->len) {
+		ctx->head = req->next;
+		if (!ctx->head) {
+			ctx->tail = NULL;
+		}
+		req->next = NULL;
+		**done_tail = req;
+		*done_tail = &req->next;
+	}
+}
+
+/* Read blocks back in order, many per readv(), and complete requests */
+static void *reader_body(void *ptr)
+{
+	struct tmod_ctx *ctx;
+	struct tmod_req *req;
+	struct tmod_req *done;
+	struct tmod_req **done_tail;
+	struct iovec iov[TMOD_BATCH_MAX];
+	unsigned long avail;
+	size_t off;
+	ssize_t len;
+	int status;
+	int cnt;
+	int i;
+
+	ctx = (struct tmod_ctx *)ptr;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		while (ctx->blks_rd == ctx->blks_wr && !ctx->err && !(ctx->stop && !ctx->head)) {
+			pthread_cond_wait(&ctx->read_cv, &ctx->lock);
+		}
+		if (ctx->err || ctx->blks_rd == ctx->blks_wr) {
+			break;
+		}
+
+		/* Never read more blocks than the device holds: read() would return 0 */
+		avail = ctx->blks_wr - ctx->blks_rd;
+		if (avail > TMOD_BATCH_MAX) {
+			avail = TMOD_BATCH_MAX;
+		}
+
+		req = ctx->head;
+		off = req->rd_off;
+		for (cnt = 0; cnt < (int)avail; cnt++) {
+			iov[cnt].iov_base = req->out + off;
+			iov[cnt].iov_len = blk_cut(ctx, req->len - off);
+
+			off += iov[cnt].iov_len;
+			if (off == req->len) {
+				req = req->next;
+				off = 0;
+			}
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		/* Records carry a header: one read() each */
+		status = 0;
+		if (ctx->tag) {
+			cnt = 1;
+			len = read_tagged(ctx, iov, &status);
+		} else {
+			len = readv(ctx->fd, iov, cnt);
+			if (len < 0) {
+				len = -errno;
+			}
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		if (len == -EINTR) {
+			continue;
+		}
+
+		/* The first block was lost in a stage */
+		if (len == -EIO) {
+			cnt = 1;
+			len = (ssize_t)iov[0].iov_len;
+			status = -EIO;
+		}
+		if (len <= 0) {
+			ctx->err = len ? (int)len : -EIO;
+			break;
+		}
+
+		/* Account the blocks and detach completed requests */
+		done = NULL;
+		done_tail = &done;
+		for (i = 0; i < cnt && (size_t)len >= iov[i].iov_len; i++) {
+			len -= iov[i].iov_len;
+			blk_done(ctx, iov[i].iov_len, status, &done_tail);
+		}
+
+		/*
+		 * readv() stops at a lost block and drops the -EIO of its read().
+		 * Signals are blocked here and every block read has been written,
+		 * so stopping on a block boundary means block i was lost.
+		 */
+		if (!len && i < cnt) {
+			blk_done(ctx, iov[i].iov_len, -EIO, &done_tail);
+		}
+
+		/* A shorter block: the stage chain changed the length */
+		if (len) {
+			ctx->err = -EPROTO;
+		}
+		pthread_cond_signal(&ctx->write_cv);
+
+		pthread_mutex_unlock(&ctx->lock);
+		run_callbacks(done);
+		pthread_mutex_lock(&ctx->lock);
+
+		if (ctx->err) {
+			break;
+		}
+	}
+
+	/* Fail whatever is left (error) */
+	done = fail_all(ctx, ctx->err ? ctx->err : -ECANCELED);
+	pthread_cond_signal(&ctx->write_cv);
+	pthread_mutex_unlock(&ctx->lock);
+
+	run_callbacks(done);
+
+	return NULL;
+}
+
+/*------------------------------ Pool --------------------------------*/
+
+static int pool_init(struct tmod_ctx *ctx, size_t bufs, size_t buf_len)
+{
+	long page;
+	size_t i;
+
+	page = sysconf(_SC_PAGESIZE);
+
+	/* Page aligned buffers */
+	buf_len = (buf_len + page - 1) / page * page;
+
+	if (posix_memalign((void **)&ctx->pool_mem, page, bufs * buf_len)) {
+		return -ENOMEM;
+	}
+
+	ctx->pool = calloc(bufs, sizeof(*ctx->pool));
+	ctx->pool_out = calloc(bufs, sizeof(*ctx->pool_out));
+	if (!ctx->pool || !ctx->pool_out) {
+		free(ctx->pool_out);
+		free(ctx->pool);
+		free(ctx->pool_mem);
+		ctx->pool_mem = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < bufs; i++) {
+		ctx->pool[i] = ctx->pool_mem + i * buf_len;
+	}
+
+	ctx->pool_bufs = bufs;
+	ctx->pool_free = bufs;
+	ctx->pool_buf_len = buf_len;
+
+	pthread_mutex_init(&ctx->pool_lock, NULL);
+
+	return 0;
+}
+
+static void pool_destroy(struct tmod_ctx *ctx)
+{
+	pthread_mutex_destroy(&ctx->pool_lock);
+	free(ctx->pool_out);
+	free(ctx->pool);
+	free(ctx->pool_mem);
+}
+
+void *tmod_buf_get(struct tmod_ctx *ctx)
+{
+	char *buf = NULL;
+
+	pthread_mutex_lock(&ctx->pool_lock);
+	if (ctx->pool_free) {
+		buf = ctx->pool[--ctx->pool_free];
+		ctx->pool_out[(buf - ctx->pool_mem) / ctx->pool_buf_len] = 1;
+	}
+	pthread_mutex_unlock(&ctx->pool_lock);
+
+	return buf;
+}
+
+int tmod_buf_put(struct tmod_ctx *ctx, void *buf)
+{
+	size_t off;
+	size_t idx;
+
+	if (!buf) {
+		return 0;
+	}
+
+	/* Only buffers of this pool, each back once */
+	if ((char *)buf < ctx->pool_mem) {
+		return -EINVAL;
+	}
+	off = (char *)buf - ctx->pool_mem;
+	idx = off / ctx->pool_buf_len;
+	if (idx >= ctx->pool_bufs || off % ctx->pool_buf_len) {
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&ctx->pool_lock);
+	if (!ctx->pool_out[idx] || ctx->pool_free == ctx->pool_bufs) {
+		pthread_mutex_unlock(&ctx->pool_lock);
+		return -EINVAL;
+	}
+	ctx->pool_out[idx] = 0;
+	ctx->pool[ctx->pool_free++] = buf;
+	pthread_mutex_unlock(&ctx->pool_lock);
+
+	return 0;
+}
+
+size_t tmod_buf_len(const struct tmod_ctx *ctx)
+{
+	return ctx->pool_buf_len;
+}
+
+/*----------------------------- Context ------------------------------*/
+
+int tmod_open(struct tmod_ctx **ctx, const struct tmod_opts *opts)
+{
+	struct tmod_opts def_opts;
+	sigset_t old_sigs;
+	sigset_t sigs;
+	char val[32];
+	int retval;
+
+	if (!opts) {
+		memset(&def_opts, 0, sizeof(def_opts));
+		opts = &def_opts;
+	}
+
+	*ctx = calloc(1, sizeof(**ctx));
+	if (!(*ctx)) {
+		return -ENOMEM;
+	}
+
+	/* Module parameters, unless given */
+	(*ctx)->blk_mlen = opts->blk_mlen;
+	if (!(*ctx)->blk_mlen) {
+		if (read_param("blk_mlen", val, sizeof(val)) < 0) {
+			free(*ctx);
+			return -ENODEV;
+		}
+		(*ctx)->blk_mlen = strtoul(val, NULL, 10);
+	}
+
+	(*ctx)->blk_mnum = opts->blk_mnum;
+	if (!(*ctx)->blk_mnum && queue_blks((*ctx)->blk_mlen, &(*ctx)->blk_mnum) < 0) {
+		free(*ctx);
+		return -ENODEV;
+	}
+
+	(*ctx)->tag = opts->tag > 0;
+	if (!opts->tag && !read_param("tag", val, sizeof(val))) {
+		(*ctx)->tag = val[0] == 'Y';
+	}
+
+	/*
+	 * Coalescing merges small blocks: the block boundaries no longer
+	 * match the requests. Full blocks are written anyway.
+	 */
+	if (!read_param("coalesce_us", val, sizeof(val)) && strtoul(val, NULL, 10)) {
+		free(*ctx);
+		return -EOPNOTSUPP;
+	}
+
+	if ((*ctx)->tag) {
+		(*ctx)->rec = malloc(sizeof(struct tmod_rec_hdr) + (*ctx)->blk_mlen);
+		if (!(*ctx)->rec) {
+			free(*ctx);
+			return -ENOMEM;
+		}
+	}
+
+	retval = pool_init(*ctx, opts->pool_bufs ? opts->pool_bufs : TMOD_POOL_BUFS,
+						opts->pool_buf_len ? opts->pool_buf_len : TMOD_POOL_BUF_LEN);
+	if (retval) {
+		free((*ctx)->rec);
+		free(*ctx);
+		return retval;
+	}
+
+	/* Open device file */
+	if (opts->dev_fd > 0) {
+		(*ctx)->fd = opts->dev_fd;
+	} else {
+		(*ctx)->fd = open(opts->dev_path ? opts->dev_path : TMOD_DEV_PATH, O_RDWR);
+		if ((*ctx)->fd < 0) {
+			retval = -errno;
+			pool_destroy(*ctx);
+			free((*ctx)->rec);
+			free(*ctx);
+			return retval;
+		}
+		(*ctx)->own_fd = 1;
+	}
+
+	pthread_mutex_init(&(*ctx)->lock, NULL);
+	pthread_cond_init(&(*ctx)->write_cv, NULL);
+	pthread_cond_init(&(*ctx)->read_cv, NULL);
+
+	/*
+	 * Create workers with all signals blocked: a readv() then only stops
+	 * early on a lost block (see reader_body())
+	 */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_SETMASK, &sigs, &old_sigs);
+
+	retval = pthread_create(&(*ctx)->writer_tr, NULL, writer_body, *ctx);
+	if (!retval) {
+		retval = pthread_create(&(*ctx)->reader_tr, NULL, reader_body, *ctx);
+		if (retval) {
+			pthread_mutex_lock(&(*ctx)->lock);
+			(*ctx)->stop = 1;
+			pthread_cond_signal(&(*ctx)->write_cv);
+			pthread_mutex_unlock(&(*ctx)->lock);
+			pthread_join((*ctx)->writer_tr, NULL);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+	if (retval) {
+		if ((*ctx)->own_fd) {
+			close((*ctx)->fd);
+		}
+		pthread_cond_destroy(&(*ctx)->read_cv);
+		pthread_cond_destroy(&(*ctx)->write_cv);
+		pthread_mutex_destroy(&(*ctx)->lock);
+		pool_destroy(*ctx);
+		free((*ctx)->rec);
+		free(*ctx);
+		return -retval;
+	}
+
+	return 0;
+}
+
+void tmod_close(struct tmod_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stop = 1;
+	pthread_cond_signal(&ctx->write_cv);
+	pthread_cond_signal(&ctx->read_cv);
+	pthread_mutex_unlock(&ctx->lock);
+
+	/* Wait for workers*/
+	pthread_join(ctx->writer_tr, NULL);
+	pthread_join(ctx->reader_tr, NULL);
+
+	if (ctx->own_fd) {
+		close(ctx->fd);
+	}
+
+	pthread_cond_destroy(&ctx->read_cv);
+	pthread_cond_destroy(&ctx->write_cv);
+	pthread_mutex_destroy(&ctx->lock);
+	pool_destroy(ctx);
+
+	free(ctx->rec);
+	free(ctx);
+}
+
+size_t tmod_blk_mlen(const struct tmod_ctx *ctx)
+{
+	return ctx->blk_mlen;
+}
+
+/*---------------------------- Requests ------------------------------*/
+
+int tmod_submit(struct tmod_ctx *ctx, const void *in, void *out, size_t len,
+				tmod_cb_t cb, void *arg)
+{
+	struct tmod_req *req;
+	int retval;
+
+	if (!len) {
+		if (cb) {
+			cb(arg, 0, out, 0);
+		}
+		return 0;
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		return -ENOMEM;
+	}
+
+	req->in = in;
+	req->out = out;
+	req->len = len;
+	req->cb = cb;
+	req->arg = arg;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->err || ctx->stop) {
+		retval = ctx->err ? ctx->err : -ESHUTDOWN;
+		pthread_mutex_unlock(&ctx->lock);
+		free(req);
+		return retval;
+	}
+
+	if (ctx->tail) {
+		ctx->tail->next = req;
+	} else {
+		ctx->head = req;
+	}
+	ctx->tail = req;
+
+	if (!ctx->wr_req) {
+		ctx->wr_req = req;
+		pthread_cond_signal(&ctx->write_cv);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return 0;
+}
+
+static void future_cb(void *arg, int status, void *out, size_t len)
+{
+	struct tmod_future *future;
+
+	(void)out;
+	(void)len;
+
+	future = (struct tmod_future *)arg;
+
+	pthread_mutex_lock(&future->lock);
+	future->status = status;
+	future->done = 1;
+	pthread_cond_signal(&future->done_cv);
+	pthread_mutex_unlock(&future->lock);
+}
+
+int tmod_submit_future(struct tmod_ctx *ctx, const void *in, void *out, size_t len,
+						struct tmod_future **future)
+{
+	int retval;
+
+	*future = calloc(1, sizeof(**future));
+	if (!(*future)) {
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&(*future)->lock, NULL);
+	pthread_cond_init(&(*future)->done_cv, NULL);
+
+	retval = tmod_submit(ctx, in, out, len, future_cb, *future);
+	if (retval) {
+		pthread_cond_destroy(&(*future)->done_cv);
+		pthread_mutex_destroy(&(*future)->lock);
+		free(*future);
+		*future = NULL;
+	}
+
+	return retval;
+}
+
+int tmod_future_wait(struct tmod_future *future)
+{
+	int status;
+
+	pthread_mutex_lock(&future->lock);
+	while (!future->done) {
+		pthread_cond_wait(&future->done_cv, &future->lock);
+	}
+	status = future->status;
+	pthread_mutex_unlock(&future->lock);
+
+	pthread_cond_destroy(&future->done_cv);
+	pthread_mutex_destroy(&future->lock);
+	free(future);
+
+	return status;
+}
+
+int tmod_encode(struct tmod_ctx *ctx, const void *in, void *out, size_t len)
+{
+	struct tmod_future *future;
+	int retval;
+
+	retval = tmod_submit_future(ctx, in, out, len, &future);
+	if (retval) {
+		return retval;
+	}
+
+	return tmod_future_wait(future);
+}
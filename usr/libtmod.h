@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#ifndef LIBTMOD_H
+#define LIBTMOD_H
+
+#include <stddef.h>
+
+/*
+ * Client library for /dev/enc_dev.
+ *
+ * Requests of any length are split into blk_mlen blocks, written by a
+ * submission thread and read back in order by a completion thread, so
+ * the device queues stay full. Blocks of several queued requests are
+ * batched into a single writev()/readv(): the device takes one block per
+ * iovec. At most a queue worth of blocks is in flight, so a batch always
+ * fits the first queue and writev() never waits on the completion thread.
+ * The stage chain must preserve the block length (e.g. xor), the
+ * output of a request has the same length as its input. The module must
+ * not coalesce writes (coalesce_us=0), tmod_open() fails otherwise.
+ *
+ * Functions return zero (or a length) on success and -errno on error.
+ */
+
+struct tmod_ctx;
+struct tmod_future;
+
+/*
+ * Completion callback, called from the completion thread. status is
+ * -EIO if a stage failed on a block of the request (its output is
+ * stale), -EBADMSG on a tag mismatch.
+ */
+typedef void (*tmod_cb_t)(void *arg, int status, void *out, size_t len);
+
+/* Zero fields select the default or the value read from sysfs */
+struct tmod_opts {
+	const char *dev_path;	/* default /dev/enc_dev */
+	int dev_fd;				/* already open device, used if > 0 */
+	size_t blk_mnum;		/* blocks fitting a queue, from blk_mnum, queue_kb, blk_slots */
+	size_t blk_mlen;		/* module blk_mlen */
+	int tag;				/* module tag: 1 on, -1 off */
+	size_t pool_bufs;		/* buffers in the pool, default 16 */
+	size_t pool_buf_len;	/* bytes per pool buffer, default 256 KiB */
+};
+
+int tmod_open(struct tmod_ctx **ctx, const struct tmod_opts *opts);
+
+/* Wait for the outstanding requests, then release everything */
+void tmod_close(struct tmod_ctx *ctx);
+
+/* Block length requests are split into */
+size_t tmod_blk_mlen(const struct tmod_ctx *ctx);
+
+/*
+ * Pool of page aligned buffers, tmod_buf_get() returns NULL if empty.
+ * tmod_buf_put() returns -EINVAL for a buffer not currently taken from
+ * this pool (double put or foreign pointer).
+ */
+void *tmod_buf_get(struct tmod_ctx *ctx);
+int tmod_buf_put(struct tmod_ctx *ctx, void *buf);
+size_t tmod_buf_len(const struct tmod_ctx *ctx);
+
+/* Encode len bytes of in into out, cb is called once done */
+int tmod_submit(struct tmod_ctx *ctx, const void *in, void *out, size_t len,
+				tmod_cb_t cb, void *arg);
+
+/* Same as tmod_submit() with a future to wait on (and free) */
+int tmod_submit_future(struct tmod_ctx *ctx, const void *in, void *out, size_t len,
+						struct tmod_future **future);
+int tmod_future_wait(struct tmod_future *future);
+
+/* Synchronous convenience call */
+int tmod_encode(struct tmod_ctx *ctx, const void *in, void *out, size_t len);
+
+#endif /* LIBTMOD_H */
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2018, Marco Pagani.
+ * <marco.pag(at)outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libtmod.h"
+
+/* Same XOR key as the module default */
+static const char key = 'k';
+
+/*
+ * Request lengths, cycled: less than a block, around blk_mlen and a
+ * whole pool buffer (many blocks, more than a queue holds)
+ */
+#define LEN_BUF		0
+#define LEN_BLK		1
+
+static const struct {
+	int unit;
+	long mul;
+	long add;
+} lens[] = {
+	{ LEN_BLK, 0, 1 },
+	{ LEN_BLK, 1, -1 },
+	{ LEN_BLK, 1, 0 },
+	{ LEN_BLK, 3, 5 },
+	{ LEN_BUF, 1, 0 },
+	{ LEN_BLK, 0, 7 },
+};
+
+struct chunk {
+	char *in;
+	char *out;
+	off_t off;
+	size_t len;
+};
+
+static struct tmod_ctx *ctx;
+static int out_fd;
+static int errors;
+
+/* Requests waiting for a pool buffer */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t put_cv = PTHREAD_COND_INITIALIZER;
+
+/* Completion: callbacks run in submission order, append the output */
+static void chunk_done(void *arg, int status, void *out, size_t len)
+{
+	struct chunk *chk;
+	
+	chk = (struct chunk *)arg;
+	
+	if (status) {
+		printf("libtmod_tester: request at byte %li failed: %s\n",
+				chk->off, strerror(-status));
+		errors++;
+	} else if (pwrite(out_fd, out, len, chk->off) != (ssize_t)len) {
+		printf("libtmod_tester: write on data out file\n");
+		errors++;
+	}
+	
+	pthread_mutex_lock(&lock);
+	if (tmod_buf_put(ctx, chk->in) || tmod_buf_put(ctx, chk->out)) {
+		printf("libtmod_tester: pool buffer rejected\n");
+		errors++;
+	}
+	pthread_cond_signal(&put_cv);
+	pthread_mutex_unlock(&lock);
+	
+	free(chk);
+}
+
+/* Wait for a pool buffer */
+static void *buf_get(void)
+{
+	void *buf;
+	
+	pthread_mutex_lock(&lock);
+	while (buf = tmod_buf_get(ctx), !buf) {
+		pthread_cond_wait(&put_cv, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+	
+	return buf;
+}
+
+/* Submit the whole input file asynchronously, one pool buffer pair per request */
+static int encode_file(int in_fd)
+{
+	struct chunk *chk;
+	off_t off = 0;
+	ssize_t len;
+	long size;
+	int i = 0;
+	
+	for (;;) {
+		if (lens[i].unit == LEN_BUF) {
+			size = lens[i].mul * (long)tmod_buf_len(ctx) + lens[i].add;
+		} else {
+			size = lens[i].mul * (long)tmod_blk_mlen(ctx) + lens[i].add;
+		}
+		i = (i + 1) % (int)(sizeof(lens) / sizeof(lens[0]));
+		if (size <= 0 || (size_t)size > tmod_buf_len(ctx)) {
+			continue;
+		}
+		
+		chk = calloc(1, sizeof(*chk));
+		if (!chk) {
+			return -1;
+		}
+		chk->in = buf_get();
+		chk->out = buf_get();
+		chk->off = off;
+		
+		len = read(in_fd, chk->in, size);
+		if (len <= 0) {
+			tmod_buf_put(ctx, chk->in);
+			tmod_buf_put(ctx, chk->out);
+			free(chk);
+			return len < 0 ? -1 : 0;
+		}
+		chk->len = len;
+		off += len;
+		
+		if (tmod_submit(ctx, chk->in, chk->out, chk->len, chunk_done, chk)) {
+			printf("libtmod_tester: submit failed\n");
+			return -1;
+		}
+	}
+}
+
+/* Synchronous path, on a stack buffer */
+static int encode_sync(void)
+{
+	char in[100];
+	char out[100];
+	size_t cursor;
+	
+	memset(in, 'a', sizeof(in));
+	
+	if (tmod_encode(ctx, in, out, sizeof(in))) {
+		return -1;
+	}
+	
+	for (cursor = 0; cursor < sizeof(in); cursor++) {
+		if (out[cursor] != (in[cursor] ^ key)) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+static int check_enc(int in_fd, int out_fd, off_t size)
+{
+	char src;
+	char enc;
+	off_t cursor = 0;
+	
+	while (cursor < size) {
+		if (read(in_fd, &src, 1) <= 0 || read(out_fd, &enc, 1) <= 0) {
+			printf("libtmod_tester: access error on check\n");
+			return -1;
+		}
+		if ((enc ^ key) != src) {
+			printf("libtmod_tester: char mismatch at byte %li\n", cursor);
+			return -1;
+		}
+		cursor++;
+	}
+	
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct stat sb;
+	int retval = 0;
+	int in_fd;
+	
+	if (argc <= 2) {
+		printf("usage: libtmod_tester <data out> <data in>\n");
+		return -1;
+	}
+	
+	in_fd = open(argv[2], O_RDONLY);
+	if (in_fd < 0 || fstat(in_fd, &sb) < 0) {
+		perror("libtmod_tester: on open data in file");
+		return -1;
+	}
+	
+	out_fd = open(argv[1], O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (out_fd < 0) {
+		perror("libtmod_tester: on open data out file");
+		close(in_fd);
+		return -1;
+	}
+	
+	/* Block length, queue size and tag mode from the module parameters */
+	retval = tmod_open(&ctx, NULL);
+	if (retval) {
+		printf("libtmod_tester: tmod_open: %s\n", strerror(-retval));
+		close(out_fd);
+		close(in_fd);
+		return -1;
+	}
+	
+	if (encode_sync()) {
+		printf("libtmod_tester: tmod_encode error\n");
+		errors++;
+	}
+	
+	if (encode_file(in_fd)) {
+		printf("libtmod_tester: access error on data in file\n");
+		errors++;
+	}
+	
+	/* Waits for the outstanding requests */
+	tmod_close(ctx);
+	
+	lseek(in_fd, 0, SEEK_SET);
+	lseek(out_fd, 0, SEEK_SET);
+	
+	if (!errors && !check_enc(in_fd, out_fd, sb.st_size)) {
+		printf("libtmod_tester: encryption done\n");
+	} else {
+		printf("libtmod_tester: encryption error\n");
+		retval = -1;
+	}
+	
+	close(out_fd);
+	close(in_fd);
+	
+	return retval;
+}
@@ -10,16 +10,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#include "../kmod/tmod_uapi.h"
+
 #define BLK_MLEN 64
 
 static const char key = 'k';
 static const char *dev_path = "/dev/enc_dev";
+static const char *tag_param_path = "/sys/module/tmod_enc/parameters/tag";
+
+/* Blocks come with a CRC32C record header (module loaded with tag=1) */
+static int tagged;
+static int tag_errors;
 
 struct file_args {
 	int fd;
@@ -27,6 +35,73 @@ struct file_args {
 	off_t size;
 };
 
+/* Bitwise CRC32C (Castagnoli, reflected), same parameters as the module */
+static __u32 crc32c(const char *data, off_t len)
+{
+	__u32 crc = ~0U;
+	off_t cursor;
+	int bit;
+	
+	for (cursor = 0; cursor < len; cursor++) {
+		crc ^= (unsigned char)data[cursor];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		}
+	}
+	
+	return ~crc;
+}
+
+/* Source block CRCs in write order, matched against the record crc_in */
+#define CRC_FIFO_LEN 1024
+
+static __u32 crc_fifo[CRC_FIFO_LEN];
+static unsigned long crc_head;
+static unsigned long crc_tail;
+static int crc_done;
+static pthread_mutex_t crc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crc_cv = PTHREAD_COND_INITIALIZER;
+
+static void crc_push(__u32 crc)
+{
+	pthread_mutex_lock(&crc_lock);
+	while (crc_tail - crc_head == CRC_FIFO_LEN) {
+		pthread_cond_wait(&crc_cv, &crc_lock);
+	}
+	crc_fifo[crc_tail++ % CRC_FIFO_LEN] = crc;
+	pthread_cond_broadcast(&crc_cv);
+	pthread_mutex_unlock(&crc_lock);
+}
+
+/* No more source blocks */
+static void crc_close(void)
+{
+	pthread_mutex_lock(&crc_lock);
+	crc_done = 1;
+	pthread_cond_broadcast(&crc_cv);
+	pthread_mutex_unlock(&crc_lock);
+}
+
+/* Returns -1 if the writer is done and nothing is left */
+static int crc_pop(__u32 *crc)
+{
+	int retval = 0;
+	
+	pthread_mutex_lock(&crc_lock);
+	while (crc_tail == crc_head && !crc_done) {
+		pthread_cond_wait(&crc_cv, &crc_lock);
+	}
+	if (crc_tail == crc_head) {
+		retval = -1;
+	} else {
+		*crc = crc_fifo[crc_head++ % CRC_FIFO_LEN];
+		pthread_cond_broadcast(&crc_cv);
+	}
+	pthread_mutex_unlock(&crc_lock);
+	
+	return retval;
+}
+
 /* Write data file into device file */
 void *writer_body(void *ptr)
 {
@@ -37,6 +112,11 @@ void *writer_body(void *ptr)
 	f_args = (struct file_args *)ptr;
 	
 	while (len = read(f_args->fd, &blk, BLK_MLEN), len > 0) {
+		/* Queued before the write, the record may be read right after */
+		if (tagged) {
+			crc_push(crc32c(blk, len));
+		}
+		
 		len = write(f_args->dev_fd, &blk, len);
 		if (len < 0) {
 			printf("tmod_tester: writer_body write");
@@ -44,22 +124,63 @@ void *writer_body(void *ptr)
 		}
 	}
 	
+	crc_close();
+	
 	return NULL;
 }
 
+/* Check a tagged record and strip its header, returns the data length */
+static off_t check_tag(char *rec, off_t len, off_t blk_cnt)
+{
+	struct tmod_rec_hdr *hdr;
+	__u32 crc_src;
+	
+	hdr = (struct tmod_rec_hdr *)rec;
+	if (len < (off_t)sizeof(*hdr) || hdr->len != len - sizeof(*hdr)) {
+		printf("tmod_tester: bad record header at block %li\n", blk_cnt);
+		tag_errors++;
+		return -1;
+	}
+	len = hdr->len;
+	
+	/* Output against its own tag, input against the block written */
+	if (crc32c(rec + sizeof(*hdr), len) != hdr->crc_out) {
+		printf("tmod_tester: CRC32C mismatch of the output at block %li\n", blk_cnt);
+		tag_errors++;
+	}
+	
+	if (crc_pop(&crc_src) < 0 || crc_src != hdr->crc_in) {
+		printf("tmod_tester: CRC32C mismatch of the input at block %li\n", blk_cnt);
+		tag_errors++;
+	}
+	
+	memmove(rec, rec + sizeof(*hdr), len);
+	
+	return len;
+}
+
 /* Read data from device to data file */
 void *reader_body(void *ptr)
 {
 	off_t len;
+	off_t blk_cnt = 0;
 	struct file_args *f_args;
-	char blk[BLK_MLEN];
+	char blk[sizeof(struct tmod_rec_hdr) + BLK_MLEN];
 	
 	f_args = (struct file_args *)ptr;
 	
 	/* Write before read */
 	sleep(1);
 	
-	while (len = read(f_args->dev_fd, &blk, BLK_MLEN), len > 0) {
+	while (len = read(f_args->dev_fd, &blk, sizeof(blk)), len > 0) {
+		if (tagged) {
+			len = check_tag(blk, len, blk_cnt);
+			if (len < 0) {
+				break;
+			}
+		}
+		blk_cnt++;
+		
 		len = write(f_args->fd, &blk, len);
 		if (len < 0) {
 			printf("tmod_tester: reader_body write\n");
@@ -70,6 +191,25 @@ void *reader_body(void *ptr)
 	return NULL;
 }
 
+/* Read the module tag parameter ("Y" or "N") */
+static int tag_enabled(void)
+{
+	char val = 'N';
+	int fd;
+	
+	fd = open(tag_param_path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	
+	if (read(fd, &val, 1) != 1) {
+		val = 'N';
+	}
+	close(fd);
+	
+	return val == 'Y';
+}
+
 int check_enc(struct file_args *data_in_f, struct file_args *data_out_f)
 {
 	char src;
@@ -161,6 +301,8 @@ int main(int argc, char **argv)
 	
 	data_out_f->dev_fd = data_in_f->dev_fd;
 	
+	tagged = tag_enabled();
+	
 	/* Create workers */
 	pthread_create(&writer_tr, NULL, writer_body, (void *)data_in_f);
 	pthread_create(&reader_tr, NULL, reader_body, (void *)data_out_f);
@@ -169,12 +311,18 @@ int main(int argc, char **argv)
 	pthread_join(writer_tr, NULL);
 	pthread_join(reader_tr, NULL);
 	
+	/* Records never read back */
+	if (tagged && crc_tail != crc_head) {
+		printf("tmod_tester: %lu blocks missing\n", crc_tail - crc_head);
+		tag_errors++;
+	}
+	
 	/* Rewind file position and check */
 	lseek(data_in_f->fd, 0, SEEK_SET);
 	lseek(data_out_f->fd, 0, SEEK_SET);
 	
-	if (!check_enc(data_in_f, data_out_f)) {
-		printf("tmod_tester: encryption done\n");
+	if (!check_enc(data_in_f, data_out_f) && !tag_errors) {
+		printf("tmod_tester: encryption done%s\n", tagged ? " (CRC32C tags verified)" : "");
 	} else {
 		printf("tmod_tester: encryption error\n");
 		retval = -1;